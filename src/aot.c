@@ -0,0 +1,385 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "aot.h"
+#include "cache.h"
+#include "chunk.h"
+#include "common.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+// every function becomes a C function that runs the top frame the same way
+// run() would, with a goto for each jump. the bytecode itself is still
+// embedded as a .loxc so constants, line numbers and globals come from the
+// same loader as `clox file.lox`
+static const char *const PRELUDE[] = {
+    "#include <math.h>",
+    "#include <stdlib.h>",
+    "",
+    "#include \"cache.h\"",
+    "#include \"object.h\"",
+    "#include \"runtime.h\"",
+    "#include \"vm.h\"",
+    "",
+    "#define PUSH(value) (*vm->sp++ = (value))",
+    "#define POP()       (*(--vm->sp))",
+    "#define PEEK(dist)  (*(vm->sp - 1 - (dist)))",
+    "",
+    "// runtime errors use the ip to find the line",
+    "#define AT(offset) (frame->ip = code + (offset) + 1)",
+    "",
+    "#define NUMBERS(offset, msg, n) \\",
+    "    do { \\",
+    "        if (!IS_NUMBER(PEEK(0)) || (n > 1 && !IS_NUMBER(PEEK(1)))) { \\",
+    "            AT(offset); \\",
+    "            runtimeError(vm, msg); \\",
+    "            return false; \\",
+    "        } \\",
+    "    } while (false)",
+    "",
+    "#define BINARY_OP(offset, valueType, op) \\",
+    "    do { \\",
+    "        NUMBERS(offset, \"Operands must be numbers\", 2); \\",
+    "        double b = AS_NUMBER(POP()); \\",
+    "        double a = AS_NUMBER(POP()); \\",
+    "        PUSH(valueType(a op b)); \\",
+    "    } while (false)",
+    "",
+    "#define ADD_ERROR \"Operands must be two numbers or two strings\"",
+    "#define ADD(offset) \\",
+    "    do { \\",
+    "        if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) { \\",
+    "            concatenate(vm); \\",
+    "        } else { \\",
+    "            NUMBERS(offset, ADD_ERROR, 2); \\",
+    "            double b = AS_NUMBER(POP()); \\",
+    "            double a = AS_NUMBER(POP()); \\",
+    "            PUSH(NUMBER_VAL(a + b)); \\",
+    "        } \\",
+    "    } while (false)",
+    "",
+    "#define MOD(offset) \\",
+    "    do { \\",
+    "        NUMBERS(offset, \"Operands must be numbers\", 2); \\",
+    "        double b = AS_NUMBER(POP()); \\",
+    "        double a = AS_NUMBER(POP()); \\",
+    "        PUSH(NUMBER_VAL(fmod(a, b))); \\",
+    "    } while (false)",
+    "",
+    "#define NEGATE(offset) \\",
+    "    do { \\",
+    "        NUMBERS(offset, \"Operand must be a number\", 1); \\",
+    "        vm->sp[-1] = NUMBER_VAL(-AS_NUMBER(vm->sp[-1])); \\",
+    "    } while (false)",
+    "",
+    "#define GLOBAL(offset, index) \\",
+    "    do { \\",
+    "        if (IS_EMPTY(vm->globalValues.values[index])) { \\",
+    "            AT(offset); \\",
+    "            undefinedGlobal(vm, index); \\",
+    "            return false; \\",
+    "        } \\",
+    "    } while (false)",
+    "",
+    "#define CHECK(offset, ok) \\",
+    "    do { \\",
+    "        AT(offset); \\",
+    "        if (!(ok)) return false; \\",
+    "    } while (false)",
+    "",
+    "// closures called by a call are run straight away",
+    "#define CALL(offset, call) \\",
+    "    do { \\",
+    "        AT(offset); \\",
+    "        int frameCount = vm->frameCount; \\",
+    "        if (!(call) || !runCallee(vm, frameCount)) return false; \\",
+    "    } while (false)",
+    "",
+    "#define RETURN() \\",
+    "    do { \\",
+    "        Value result = POP(); \\",
+    "        closeUpvalues(vm, slots); \\",
+    "        vm->frameCount--; \\",
+    "        vm->sp = slots; \\",
+    "        if (vm->frameCount > 0) PUSH(result); \\",
+    "        return true; \\",
+    "    } while (false)",
+};
+
+static void collectFunctions(VM *vm, ValueArray *fns, ObjFn *script) {
+    writeValueArray(vm, fns, OBJ_VAL(script));
+    for (int i = 0; i < fns->cnt; i++) {
+        ValueArray *consts = &AS_FUNCTION(fns->values[i])->chunk.constants;
+        for (int j = 0; j < consts->cnt; j++) {
+            if (IS_FUNCTION(consts->values[j])) {
+                writeValueArray(vm, fns, consts->values[j]);
+            }
+        }
+    }
+}
+
+static inline int jumpTarget(const Chunk *chunk, int offset) {
+    uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8) |
+                    chunk->code[offset + 2];
+    if (chunk->code[offset] == OP_LOOP) return offset + 3 - jump;
+    return offset + 3 + jump;
+}
+
+static bool *findJumpTargets(const Chunk *chunk) {
+    bool *targets = (bool *)calloc(chunk->cnt + 1, sizeof(bool));
+    if (targets == NULL) exit(1);
+
+    for (int i = 0; i < chunk->cnt; i += 1 + getArgCount(chunk, i)) {
+        OpCode op = (OpCode)chunk->code[i];
+        if (op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP) {
+            targets[jumpTarget(chunk, i)] = true;
+        }
+    }
+    return targets;
+}
+
+static void emitClosure(FILE *out, const Chunk *chunk, int offset) {
+    uint8_t constant = chunk->code[offset + 1];
+    ObjFn *fn = AS_FUNCTION(chunk->constants.values[constant]);
+
+    fprintf(out, "    {\n");
+    fprintf(out, "        ObjFn *fn = AS_FUNCTION(consts[%d]);\n", constant);
+    fprintf(out, "        ObjClosure *inner = newClosure(vm, fn);\n");
+    fprintf(out, "        PUSH(OBJ_VAL(inner));\n");
+    for (int i = 0; i < fn->upvalueCnt; i++) {
+        uint8_t flags = chunk->code[offset + 2 + i * 2];
+        uint8_t index = chunk->code[offset + 3 + i * 2];
+        fprintf(out, "        inner->upvalues[%d] = ", i);
+        if (flags & UPVALUE_MUTABLE) {
+            fprintf(out, "OBJ_VAL(captureUpvalue(vm, slots + %d));\n", index);
+        } else if (flags & UPVALUE_LOCAL) {
+            fprintf(out, "slots[%d];\n", index);
+        } else {
+            fprintf(out, "closure->upvalues[%d];\n", index);
+        }
+    }
+    if (fn->upvalueCnt > 0) {
+        fprintf(out, "        writeBarrier(vm, (Obj *)inner);\n");
+    }
+    fprintf(out, "    }\n");
+}
+
+static void emitInstruction(FILE *out, const Chunk *chunk, int offset) {
+    const uint8_t *code = chunk->code + offset;
+    int arg = getArgCount(chunk, offset) > 0 ? code[1] : 0;
+
+#define EMIT(...)                                                              \
+    do {                                                                       \
+        fprintf(out, "    ");                                                  \
+        fprintf(out, __VA_ARGS__);                                             \
+        fprintf(out, "\n");                                                    \
+    } while (false)
+
+    switch ((OpCode)code[0]) {
+    case OP_NOP:   break; // every break has been patched into a jump
+    case OP_NIL:   EMIT("PUSH(NIL_VAL);"); break;
+    case OP_TRUE:  EMIT("PUSH(BOOL_VAL(true));"); break;
+    case OP_FALSE: EMIT("PUSH(BOOL_VAL(false));"); break;
+    case OP_POP:   EMIT("(void)POP();"); break;
+    case OP_INHERIT:
+        EMIT("CHECK(%d, inherit(vm));", offset);
+        break;
+    case OP_EQUAL:
+        EMIT("{ Value b = POP(), a = POP(); "
+             "PUSH(BOOL_VAL(valuesEqual(a, b))); }");
+        break;
+    case OP_NOT_EQUAL:
+        EMIT("{ Value b = POP(), a = POP(); "
+             "PUSH(BOOL_VAL(!valuesEqual(a, b))); }");
+        break;
+    case OP_GREATER:
+        EMIT("BINARY_OP(%d, BOOL_VAL, >);", offset);
+        break;
+    case OP_GREATER_EQUAL:
+        EMIT("BINARY_OP(%d, BOOL_VAL, >=);", offset);
+        break;
+    case OP_LESS:       EMIT("BINARY_OP(%d, BOOL_VAL, <);", offset); break;
+    case OP_LESS_EQUAL: EMIT("BINARY_OP(%d, BOOL_VAL, <=);", offset); break;
+    case OP_ADD:        EMIT("ADD(%d);", offset); break;
+    case OP_SUBTRACT:   EMIT("BINARY_OP(%d, NUMBER_VAL, -);", offset); break;
+    case OP_MULTIPLY:   EMIT("BINARY_OP(%d, NUMBER_VAL, *);", offset); break;
+    case OP_DIVIDE:     EMIT("BINARY_OP(%d, NUMBER_VAL, /);", offset); break;
+    case OP_MOD:        EMIT("MOD(%d);", offset); break;
+    case OP_NOT:
+        EMIT("vm->sp[-1] = BOOL_VAL(isFalsey(vm->sp[-1]));");
+        break;
+    case OP_NEGATE: EMIT("NEGATE(%d);", offset); break;
+    case OP_PRINT:  EMIT("printStatement(POP());"); break;
+    case OP_CLOSE_UPVALUE:
+        EMIT("closeUpvalues(vm, vm->sp - 1);");
+        EMIT("(void)POP();");
+        break;
+    case OP_RETURN:      EMIT("RETURN();"); break;
+    case OP_GET_INDEX:   EMIT("CHECK(%d, getIndex(vm));", offset); break;
+    case OP_SET_INDEX:   EMIT("CHECK(%d, setIndex(vm));", offset); break;
+    case OP_CONSTANT:    EMIT("PUSH(consts[%d]);", arg); break;
+    case OP_SMALL_INT:   EMIT("PUSH(NUMBER_VAL(%d));", arg); break;
+    case OP_BUILD_ARRAY: EMIT("buildArray(vm, %d);", arg); break;
+    case OP_BUILD_MAP:
+        EMIT("CHECK(%d, buildMap(vm, %d));", offset, arg);
+        break;
+    case OP_METHOD: EMIT("defineMethod(vm, consts[%d]);", arg); break;
+    case OP_DEFINE_GLOBAL:
+        EMIT("vm->globalValues.values[%d] = POP();", arg);
+        break;
+    case OP_GET_GLOBAL:
+        EMIT("GLOBAL(%d, %d);", offset, arg);
+        EMIT("PUSH(vm->globalValues.values[%d]);", arg);
+        break;
+    case OP_SET_GLOBAL:
+        EMIT("GLOBAL(%d, %d);", offset, arg);
+        EMIT("vm->globalValues.values[%d] = PEEK(0);", arg);
+        break;
+    case OP_GET_LOCAL: EMIT("PUSH(slots[%d]);", arg); break;
+    case OP_SET_LOCAL: EMIT("slots[%d] = PEEK(0);", arg); break;
+    case OP_GET_PROPERTY:
+        EMIT("CHECK(%d, getProperty(vm, consts[%d]));", offset, arg);
+        break;
+    case OP_SET_PROPERTY:
+        EMIT("CHECK(%d, setProperty(vm, consts[%d]));", offset, arg);
+        break;
+    case OP_GET_UPVALUE:
+        EMIT("{");
+        EMIT("    Value value = closure->upvalues[%d];", arg);
+        EMIT("    if (IS_UPVALUE(value)) {");
+        EMIT("        value = *AS_UPVALUE(value)->location;");
+        EMIT("    }");
+        EMIT("    PUSH(value);");
+        EMIT("}");
+        break;
+    case OP_SET_UPVALUE:
+        EMIT("{");
+        EMIT("    Value upvalue = closure->upvalues[%d];", arg);
+        EMIT("    *AS_UPVALUE(upvalue)->location = PEEK(0);");
+        EMIT("    writeBarrier(vm, AS_OBJ(upvalue));");
+        EMIT("}");
+        break;
+    case OP_GET_SUPER:
+        EMIT("CHECK(%d, bindMethod(vm, AS_CLASS(POP()), consts[%d]));", offset,
+             arg);
+        break;
+    case OP_JUMP:
+    case OP_LOOP: EMIT("goto L%d;", jumpTarget(chunk, offset)); break;
+    case OP_JUMP_IF_FALSE:
+        EMIT("if (isFalsey(PEEK(0))) goto L%d;", jumpTarget(chunk, offset));
+        break;
+    case OP_CLASS:
+        EMIT("PUSH(OBJ_VAL(newClass(vm, AS_STRING(consts[%d]))));", arg);
+        break;
+    case OP_CALL:
+        EMIT("CALL(%d, callValue(vm, PEEK(%d), %d));", offset, arg, arg);
+        break;
+    case OP_INVOKE:
+        EMIT("CALL(%d, invoke(vm, consts[%d], %d));", offset, arg, code[2]);
+        break;
+    case OP_SUPER_INVOKE:
+        EMIT("{");
+        EMIT("    ObjClass *superclass = AS_CLASS(POP());");
+        EMIT("    CALL(%d, invokeFromClass(vm, superclass, consts[%d], %d));",
+             offset, arg, code[2]);
+        EMIT("}");
+        break;
+    case OP_CLOSURE: emitClosure(out, chunk, offset); break;
+    }
+
+#undef EMIT
+}
+
+static void emitFunction(FILE *out, ObjFn *fn, int index) {
+    Chunk *chunk = &fn->chunk;
+    bool *targets = findJumpTargets(chunk);
+
+    fprintf(out, "\n// %s\n", fn->name == NULL ? "<script>" : fn->name->chars);
+    fprintf(out, "static bool fn%d(VM *vm) {\n", index);
+    fprintf(out, "    CallFrame *frame = &vm->frames[vm->frameCount - 1];\n");
+    fprintf(out, "    ObjClosure *closure = frame->closure;\n");
+    fprintf(out, "    Value *slots = frame->slots;\n");
+    fprintf(out, "    Value *consts = closure->fn->chunk.constants.values;\n");
+    fprintf(out, "    uint8_t *code = closure->fn->chunk.code;\n");
+    fprintf(out, "    (void)slots, (void)consts, (void)code;\n\n");
+
+    for (int i = 0; i < chunk->cnt; i += 1 + getArgCount(chunk, i)) {
+        if (targets[i]) fprintf(out, "L%d:;\n", i);
+        emitInstruction(out, chunk, i);
+    }
+    fprintf(out, "}\n");
+
+    free(targets);
+}
+
+static void emitProgram(FILE *out, const uint8_t *bytes, size_t size) {
+    fprintf(out, "\nstatic _Alignas(8) const uint8_t PROGRAM[] = {");
+    for (size_t i = 0; i < size; i++) {
+        fprintf(out, "%s0x%02x,", i % 16 == 0 ? "\n    " : " ", bytes[i]);
+    }
+    fprintf(out, "\n};\n");
+}
+
+static const char MAIN[] =
+    "\n"
+    "int main(void) {\n"
+    "    VM vm = {0};\n"
+    "    initVM(&vm);\n"
+    "    vm.compiledFns = FUNCTIONS;\n"
+    "\n"
+    "    ObjFn *script = loadCacheBytes(&vm, PROGRAM, sizeof(PROGRAM));\n"
+    "    if (script == NULL) {\n"
+    "        fprintf(stderr, \"Could not load the program\\n\");\n"
+    "        exit(74);\n"
+    "    }\n"
+    "    if (runCompiled(&vm, script) != INTERPRET_OK) exit(70);\n"
+    "\n"
+    "    freeVM(&vm);\n"
+    "    return EXIT_SUCCESS;\n"
+    "}\n";
+
+bool writeAot(VM *vm, ObjFn *script, const char *path) {
+    // compiles any lazy bodies so every function has its bytecode. the
+    // embedded copy is never checked against a source so the hash is unused
+    size_t size = 0;
+    uint8_t *bytes = buildCache(vm, script, 0, &size);
+    if (bytes == NULL) return false;
+
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        free(bytes);
+        return false;
+    }
+
+    fprintf(out, "// generated by clox --aot\n");
+    for (size_t i = 0; i < ARRAY_LEN(PRELUDE); i++) {
+        fprintf(out, "%s\n", PRELUDE[i]);
+    }
+
+    // the functions are numbered in the same order as the .loxc records
+    ValueArray fns;
+    initValueArray(&fns);
+    collectFunctions(vm, &fns, script);
+    for (int i = 0; i < fns.cnt; i++) {
+        fprintf(out, "\nstatic bool fn%d(VM *vm);", i);
+    }
+    fprintf(out, "\n");
+    for (int i = 0; i < fns.cnt; i++) {
+        emitFunction(out, AS_FUNCTION(fns.values[i]), i);
+    }
+
+    fprintf(out, "\nstatic const CompiledFn FUNCTIONS[] = {");
+    for (int i = 0; i < fns.cnt; i++) {
+        fprintf(out, "%sfn%d,", i % 8 == 0 ? "\n    " : " ", i);
+    }
+    fprintf(out, "\n};\n");
+
+    emitProgram(out, bytes, size);
+    fprintf(out, "%s", MAIN);
+
+    freeValueArray(vm, &fns);
+    free(bytes);
+    return fclose(out) == 0;
+}
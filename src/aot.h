@@ -0,0 +1,12 @@
+#ifndef INCLUDE_CLOX_AOT_H_
+#define INCLUDE_CLOX_AOT_H_
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// translates `script` and every function nested in it to a C file with its
+// own main. link it with everything in src/ except main.c
+bool writeAot(VM *vm, ObjFn *script, const char *path);
+
+#endif // INCLUDE_CLOX_AOT_H_
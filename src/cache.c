@@ -0,0 +1,480 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "chunk.h"
+#include "common.h"
+#include "compiler.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+
+#define CACHE_MAGIC   "LOXC"
+#define VERSION_STAMP ((uint32_t)(CACHE_VERSION << 8 | OP_CLOSURE))
+#define NO_NAME       UINT32_MAX
+
+// a .loxc file is laid out as
+//   CacheHeader
+//   uint32_t globals[globalCnt] string index of the name of each global slot
+//   uint32_t strings[stringCnt] offset of each string: uint32_t len, chars
+//   uint32_t fns[fnCnt]         offset of each FnRecord, fns[0] is the script
+// everything is in native byte order and 8 byte aligned, only the VM that
+// wrote the file is meant to read it
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t sourceHash;
+    uint64_t size;
+    uint32_t globalCnt;
+    uint32_t stringCnt;
+    uint32_t fnCnt;
+    uint32_t pad;
+} CacheHeader;
+
+// followed by LineInfo lines[lineCnt], CacheConst consts[constCnt]
+// and then uint8_t code[codeCnt]
+typedef struct {
+    uint32_t offset; // of the record itself, so the header can be found
+    uint32_t arity;
+    uint32_t upvalueCnt;
+    uint32_t name;
+    uint32_t codeCnt;
+    uint32_t lineCnt;
+    uint32_t constCnt;
+    uint32_t pad;
+} FnRecord;
+
+typedef enum {
+    CACHE_NUMBER,
+    CACHE_STRING,
+    CACHE_FUNCTION,
+} CacheConstType;
+
+typedef struct {
+    uint32_t type;
+    uint32_t index; // of the string or the function
+    double number;
+} CacheConst;
+
+struct CacheImage {
+    const uint8_t *base;
+    size_t size;
+    struct CacheImage *next;
+};
+
+static inline const uint32_t *globalTable(const CacheHeader *header) {
+    return (const uint32_t *)(header + 1);
+}
+
+static inline const uint32_t *stringTable(const CacheHeader *header) {
+    return globalTable(header) + header->globalCnt;
+}
+
+static inline const uint32_t *fnTable(const CacheHeader *header) {
+    return stringTable(header) + header->stringCnt;
+}
+
+static inline size_t tablesSize(uint32_t globalCnt, uint32_t stringCnt,
+                                uint32_t fnCnt) {
+    return sizeof(CacheHeader) +
+           sizeof(uint32_t) * ((size_t)globalCnt + stringCnt + fnCnt);
+}
+
+static inline size_t recordSize(const FnRecord *rec) {
+    return sizeof(FnRecord) + sizeof(LineInfo) * rec->lineCnt +
+           sizeof(CacheConst) * rec->constCnt + rec->codeCnt;
+}
+
+uint64_t hashSource(const char *source) {
+    // 64 bit FNV-1a
+    uint64_t hash = 14695981039346656037u;
+    for (const char *c = source; *c != '\0'; c++) {
+        hash ^= (uint8_t)*c;
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+typedef struct {
+    uint8_t *bytes;
+    size_t cnt, cap;
+} Buffer;
+
+// returns the offset of `size` zeroed bytes at the end of the buffer
+static size_t reserve(Buffer *buf, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    while (buf->cap < buf->cnt + size) {
+        buf->cap = GROW_CAP(buf->cap);
+        buf->bytes = (uint8_t *)realloc(buf->bytes, buf->cap);
+        if (buf->bytes == NULL) exit(1);
+    }
+
+    size_t offset = buf->cnt;
+    memset(buf->bytes + offset, 0, size);
+    buf->cnt += size;
+    return offset;
+}
+
+#define AT(buf, type, offset) ((type *)((buf)->bytes + (offset)))
+
+typedef struct {
+    VM *vm;
+    Buffer buf;
+    Table stringIndex; // ObjString -> its index in `strings`
+    ValueArray strings;
+    ValueArray fns; // breadth first, so fns[0] is the script
+} Writer;
+
+static uint32_t stringIndex(Writer *w, ObjString *string) {
+    Value index = EMPTY_VAL;
+    if (tableGet(&w->stringIndex, OBJ_VAL(string), &index)) {
+        return (uint32_t)AS_NUMBER(index);
+    }
+
+    uint32_t newIndex = (uint32_t)w->strings.cnt;
+    writeValueArray(w->vm, &w->strings, OBJ_VAL(string));
+    tableSet(w->vm, &w->stringIndex, OBJ_VAL(string),
+             NUMBER_VAL((double)newIndex));
+    return newIndex;
+}
+
+static bool collectFunctions(Writer *w, ObjFn *script) {
+    writeValueArray(w->vm, &w->fns, OBJ_VAL(script));
+    for (int i = 0; i < w->fns.cnt; i++) {
+        ObjFn *fn = AS_FUNCTION(w->fns.values[i]);
+        if (fn->lazy != NULL && !compileLazy(w->vm, fn)) return false;
+
+        if (fn->name != NULL) stringIndex(w, fn->name);
+        ValueArray *consts = &fn->chunk.constants;
+        for (int j = 0; j < consts->cnt; j++) {
+            Value value = consts->values[j];
+            if (IS_FUNCTION(value)) {
+                writeValueArray(w->vm, &w->fns, value);
+            } else if (IS_STRING(value)) {
+                stringIndex(w, AS_STRING(value));
+            } else if (!IS_NUMBER(value)) {
+                fprintf(stderr, "Can't cache a %s constant\n",
+                        typeofValue(value));
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// functions are numbered in the order collectFunctions found them
+static size_t writeFunction(Writer *w, ObjFn *fn, uint32_t *nextFn) {
+    Chunk *chunk = &fn->chunk;
+    FnRecord rec = {
+        .arity = (uint32_t)fn->arity,
+        .upvalueCnt = (uint32_t)fn->upvalueCnt,
+        .name = fn->name == NULL ? NO_NAME : stringIndex(w, fn->name),
+        .codeCnt = (uint32_t)chunk->cnt,
+        .lineCnt = (uint32_t)chunk->lineCnt,
+        .constCnt = (uint32_t)chunk->constants.cnt,
+    };
+
+    size_t offset = reserve(&w->buf, recordSize(&rec));
+    rec.offset = (uint32_t)offset;
+    *AT(&w->buf, FnRecord, offset) = rec;
+
+    size_t at = offset + sizeof(FnRecord);
+    memcpy(w->buf.bytes + at, chunk->lines, sizeof(LineInfo) * rec.lineCnt);
+    at += sizeof(LineInfo) * rec.lineCnt;
+
+    for (uint32_t i = 0; i < rec.constCnt; i++, at += sizeof(CacheConst)) {
+        Value value = chunk->constants.values[i];
+        CacheConst *constant = AT(&w->buf, CacheConst, at);
+        if (IS_FUNCTION(value)) {
+            *constant = (CacheConst){CACHE_FUNCTION, (*nextFn)++, 0};
+        } else if (IS_STRING(value)) {
+            uint32_t index = stringIndex(w, AS_STRING(value));
+            *constant = (CacheConst){CACHE_STRING, index, 0};
+        } else {
+            *constant = (CacheConst){CACHE_NUMBER, 0, AS_NUMBER(value)};
+        }
+    }
+
+    memcpy(w->buf.bytes + at, chunk->code, rec.codeCnt);
+    return offset;
+}
+
+static void freeWriter(Writer *w) {
+    freeTable(w->vm, &w->stringIndex);
+    freeValueArray(w->vm, &w->strings);
+    freeValueArray(w->vm, &w->fns);
+    free(w->buf.bytes);
+}
+
+uint8_t *buildCache(VM *vm, ObjFn *script, uint64_t sourceHash, size_t *size) {
+    Writer w = {vm, {0}, {0}, {0}, {0}};
+
+    // the name of every global slot, in slot order
+    uint32_t globalCnt = (uint32_t)vm->globalValues.cnt;
+    uint32_t *globals = (uint32_t *)calloc(globalCnt + 1, sizeof(uint32_t));
+    for (int i = 0; i < vm->globalNames.cap; i++) {
+        Entry *entry = &vm->globalNames.entries[i];
+        if (IS_EMPTY(entry->key)) continue;
+        globals[(int)AS_NUMBER(entry->value)] =
+            stringIndex(&w, AS_STRING(entry->key));
+    }
+
+    if (!collectFunctions(&w, script)) {
+        free(globals);
+        freeWriter(&w);
+        return NULL;
+    }
+
+    uint32_t stringCnt = (uint32_t)w.strings.cnt;
+    uint32_t fnCnt = (uint32_t)w.fns.cnt;
+    reserve(&w.buf, tablesSize(globalCnt, stringCnt, fnCnt));
+    memcpy(w.buf.bytes + sizeof(CacheHeader), globals,
+           sizeof(uint32_t) * globalCnt);
+    free(globals);
+
+    size_t strings = sizeof(CacheHeader) + sizeof(uint32_t) * globalCnt;
+    for (uint32_t i = 0; i < stringCnt; i++) {
+        ObjString *string = AS_STRING(w.strings.values[i]);
+        size_t offset = reserve(&w.buf, sizeof(uint32_t) + string->length + 1);
+        *AT(&w.buf, uint32_t, offset) = (uint32_t)string->length;
+        memcpy(w.buf.bytes + offset + sizeof(uint32_t), string->chars,
+               string->length);
+        AT(&w.buf, uint32_t, strings)[i] = (uint32_t)offset;
+    }
+
+    size_t fns = strings + sizeof(uint32_t) * stringCnt;
+    uint32_t nextFn = 1;
+    for (uint32_t i = 0; i < fnCnt; i++) {
+        ObjFn *fn = AS_FUNCTION(w.fns.values[i]);
+        size_t offset = writeFunction(&w, fn, &nextFn);
+        AT(&w.buf, uint32_t, fns)[i] = (uint32_t)offset;
+    }
+
+    CacheHeader *header = AT(&w.buf, CacheHeader, 0);
+    memcpy(header->magic, CACHE_MAGIC, sizeof(header->magic));
+    header->version = VERSION_STAMP;
+    header->sourceHash = sourceHash;
+    header->size = w.buf.cnt;
+    header->globalCnt = globalCnt;
+    header->stringCnt = stringCnt;
+    header->fnCnt = fnCnt;
+
+    // the buffer is handed over to the caller
+    uint8_t *bytes = w.buf.bytes;
+    *size = w.buf.cnt;
+    w.buf.bytes = NULL;
+    freeWriter(&w);
+    return bytes;
+}
+
+bool writeCache(VM *vm, ObjFn *script, const char *path, uint64_t sourceHash) {
+    size_t size = 0;
+    uint8_t *bytes = buildCache(vm, script, sourceHash, &size);
+    if (bytes == NULL) return false;
+
+    FILE *f = fopen(path, "wb");
+    bool ok = f != NULL && fwrite(bytes, 1, size, f) == size;
+    if (f != NULL && fclose(f) != 0) ok = false;
+
+    free(bytes);
+    return ok;
+}
+
+// checks every offset up front so loading a body later can't go out of bounds
+static bool validImage(const uint8_t *base, size_t size, uint64_t sourceHash) {
+    if (size < sizeof(CacheHeader)) return false;
+
+    const CacheHeader *header = (const CacheHeader *)base;
+    if (memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != VERSION_STAMP || header->sourceHash != sourceHash ||
+        header->size != size || header->fnCnt == 0) {
+        return false;
+    }
+
+    if (tablesSize(header->globalCnt, header->stringCnt, header->fnCnt) >
+        size) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < header->globalCnt; i++) {
+        if (globalTable(header)[i] >= header->stringCnt) return false;
+    }
+
+    for (uint32_t i = 0; i < header->stringCnt; i++) {
+        size_t offset = stringTable(header)[i];
+        if (offset + sizeof(uint32_t) > size) return false;
+        uint32_t len = *(const uint32_t *)(base + offset);
+        if (offset + sizeof(uint32_t) + len > size) return false;
+    }
+
+    for (uint32_t i = 0; i < header->fnCnt; i++) {
+        size_t offset = fnTable(header)[i];
+        if (offset % 8 != 0 || offset + sizeof(FnRecord) > size) return false;
+
+        const FnRecord *rec = (const FnRecord *)(base + offset);
+        if (rec->offset != offset || offset + recordSize(rec) > size ||
+            (rec->name != NO_NAME && rec->name >= header->stringCnt)) {
+            return false;
+        }
+
+        const CacheConst *consts =
+            (const CacheConst *)((const LineInfo *)(rec + 1) + rec->lineCnt);
+        for (uint32_t j = 0; j < rec->constCnt; j++) {
+            if ((consts[j].type == CACHE_STRING &&
+                 consts[j].index >= header->stringCnt) ||
+                (consts[j].type == CACHE_FUNCTION &&
+                 consts[j].index >= header->fnCnt) ||
+                consts[j].type > CACHE_FUNCTION) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static ObjString *cachedString(VM *vm, const CacheHeader *header,
+                               uint32_t index) {
+    const uint8_t *base = (const uint8_t *)header;
+    const uint8_t *record = base + stringTable(header)[index];
+    uint32_t len = *(const uint32_t *)record;
+    return copyString(vm, (const char *)record + sizeof(uint32_t), (int)len);
+}
+
+// the global slots have to match the ones the bytecode was compiled with
+static bool defineGlobals(VM *vm, const CacheHeader *header) {
+    for (uint32_t i = 0; i < header->globalCnt; i++) {
+        ObjString *name = cachedString(vm, header, globalTable(header)[i]);
+        Value index = EMPTY_VAL;
+        if (tableGet(&vm->globalNames, OBJ_VAL(name), &index)) {
+            if ((uint32_t)AS_NUMBER(index) != i) return false;
+            continue;
+        }
+        if ((uint32_t)vm->globalValues.cnt != i) return false;
+
+        pushRoot(vm, OBJ_VAL(name));
+        writeValueArray(vm, &vm->globalValues, EMPTY_VAL);
+        tableSet(vm, &vm->globalNames, OBJ_VAL(name), NUMBER_VAL((double)i));
+        popRoot(vm);
+    }
+    return true;
+}
+
+static ObjFn *newCachedFunction(VM *vm, const CacheHeader *header,
+                                uint32_t index) {
+    const uint8_t *base = (const uint8_t *)header;
+    const FnRecord *rec = (const FnRecord *)(base + fnTable(header)[index]);
+
+    ObjFn *fn = newFunction(vm);
+    fn->arity = (int)rec->arity;
+    fn->upvalueCnt = (int)rec->upvalueCnt;
+    fn->cached = (const uint8_t *)rec;
+    if (vm->compiledFns != NULL) fn->compiled = vm->compiledFns[index];
+    if (rec->name != NO_NAME) {
+        pushRoot(vm, OBJ_VAL(fn));
+        ObjString *name = cachedString(vm, header, rec->name);
+        __atomic_store_n(&fn->name, name, __ATOMIC_RELEASE);
+        writeBarrier(vm, (Obj *)fn);
+        popRoot(vm);
+    }
+    return fn;
+}
+
+void loadCachedBody(VM *vm, ObjFn *fn) {
+    const FnRecord *rec = (const FnRecord *)fn->cached;
+    const CacheHeader *header = (const CacheHeader *)(fn->cached - rec->offset);
+    const LineInfo *lines = (const LineInfo *)(rec + 1);
+    const CacheConst *consts = (const CacheConst *)(lines + rec->lineCnt);
+    const uint8_t *code = (const uint8_t *)(consts + rec->constCnt);
+
+    // strings are only interned once a function that uses them is called
+    Chunk *chunk = &fn->chunk;
+    for (uint32_t i = 0; i < rec->constCnt; i++) {
+        Value value = NUMBER_VAL(consts[i].number);
+        if (consts[i].type == CACHE_STRING) {
+            value = OBJ_VAL(cachedString(vm, header, consts[i].index));
+        } else if (consts[i].type == CACHE_FUNCTION) {
+            value = OBJ_VAL(newCachedFunction(vm, header, consts[i].index));
+        }
+        pushRoot(vm, value);
+        writeValueArray(vm, &chunk->constants, value);
+        writeBarrier(vm, (Obj *)fn);
+        popRoot(vm);
+    }
+
+    chunk->lines = ALLOCATE(LineInfo, rec->lineCnt);
+    memcpy(chunk->lines, lines, sizeof(LineInfo) * rec->lineCnt);
+    chunk->lineCnt = chunk->lineCap = (int)rec->lineCnt;
+
+    // setting the code marks the body as loaded
+    uint8_t *body = ALLOCATE(uint8_t, rec->codeCnt);
+    memcpy(body, code, rec->codeCnt);
+    chunk->code = body;
+    chunk->cnt = chunk->cap = (int)rec->codeCnt;
+    fn->cached = NULL;
+}
+
+static ObjFn *loadScript(VM *vm, const uint8_t *base, size_t size,
+                        uint64_t sourceHash) {
+    const CacheHeader *header = (const CacheHeader *)base;
+    if (!validImage(base, size, sourceHash) || !defineGlobals(vm, header)) {
+        return NULL;
+    }
+
+    ObjFn *script = newCachedFunction(vm, header, 0);
+    pushRoot(vm, OBJ_VAL(script));
+    loadCachedBody(vm, script);
+    popRoot(vm);
+    return script;
+}
+
+ObjFn *loadCache(VM *vm, const char *path, uint64_t sourceHash) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = (size_t)st.st_size;
+    void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) return NULL;
+
+    ObjFn *script = loadScript(vm, mapping, size, sourceHash);
+    if (script == NULL) {
+        munmap(mapping, size);
+        return NULL;
+    }
+
+    // functions point into the mapping until their body is loaded
+    struct CacheImage *image =
+        (struct CacheImage *)malloc(sizeof(struct CacheImage));
+    if (image == NULL) exit(1);
+    *image = (struct CacheImage){mapping, size, vm->caches};
+    vm->caches = image;
+    return script;
+}
+
+ObjFn *loadCacheBytes(VM *vm, const uint8_t *bytes, size_t size) {
+    if (size < sizeof(CacheHeader)) return NULL;
+    uint64_t sourceHash = ((const CacheHeader *)bytes)->sourceHash;
+    return loadScript(vm, bytes, size, sourceHash);
+}
+
+void freeCaches(VM *vm) {
+    while (vm->caches != NULL) {
+        struct CacheImage *image = vm->caches;
+        vm->caches = image->next;
+        munmap((void *)image->base, image->size);
+        free(image);
+    }
+}
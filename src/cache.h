@@ -0,0 +1,29 @@
+#ifndef INCLUDE_CLOX_CACHE_H_
+#define INCLUDE_CLOX_CACHE_H_
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// bump whenever the bytecode or the layout of .loxc files changes
+#define CACHE_VERSION 1
+
+uint64_t hashSource(const char *source);
+
+// the .loxc contents for `script` and every function nested in it, the
+// records are in breadth first order starting with the script. returns a
+// malloc'd buffer or NULL
+uint8_t *buildCache(VM *vm, ObjFn *script, uint64_t sourceHash, size_t *size);
+bool writeCache(VM *vm, ObjFn *script, const char *path, uint64_t sourceHash);
+
+// maps `path` and returns its script function, or NULL if the file is
+// missing or was made from a different source or by a different VM.
+// nested functions are only loaded when they are first called
+ObjFn *loadCache(VM *vm, const char *path, uint64_t sourceHash);
+// same as loadCache for the contents of a .loxc that is embedded in the
+// program, `bytes` has to be 8 byte aligned and outlive the VM
+ObjFn *loadCacheBytes(VM *vm, const uint8_t *bytes, size_t size);
+void loadCachedBody(VM *vm, ObjFn *fn);
+void freeCaches(VM *vm);
+
+#endif // INCLUDE_CLOX_CACHE_H_
@@ -1,5 +1,6 @@
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
 #include "value.h"
 
 void initChunk(Chunk *chunk) { *chunk = (Chunk){0}; }
@@ -57,3 +58,65 @@ void freeChunk(VM *vm, Chunk *chunk) {
     freeValueArray(vm, &chunk->constants);
     initChunk(chunk);
 }
+
+int getArgCount(const Chunk *chunk, int offset) {
+    switch ((OpCode)chunk->code[offset]) {
+    case OP_NOP:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_POP:
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+    case OP_GREATER:
+    case OP_GREATER_EQUAL:
+    case OP_LESS:
+    case OP_LESS_EQUAL:
+    case OP_ADD:
+    case OP_MOD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_CLOSE_UPVALUE:
+    case OP_RETURN:
+    case OP_PRINT:
+    case OP_INHERIT:
+    case OP_GET_INDEX:
+    case OP_SET_INDEX:     return 0;
+
+    case OP_SMALL_INT:
+    case OP_CONSTANT:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_SUPER:
+    case OP_METHOD:
+    case OP_BUILD_ARRAY:
+    case OP_BUILD_MAP:
+    case OP_CLASS:
+    case OP_CALL:          return 1;
+
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:  return 2;
+
+    case OP_CLOSURE: {
+        int constant = chunk->code[offset + 1];
+        ObjFn *loadedFn = AS_FUNCTION(chunk->constants.values[constant]);
+
+        // There is one byte for the constant, then two for each upvalue.
+        return 1 + (loadedFn->upvalueCnt * 2);
+    }
+    }
+    return 0;
+}
@@ -61,6 +61,10 @@ typedef enum {
     OP_CLOSURE,
 } OpCode;
 
+// flags for each (flags, index) operand pair of OP_CLOSURE
+#define UPVALUE_LOCAL   1 // captures a local of the enclosing function
+#define UPVALUE_MUTABLE 2 // the local is reassigned so needs an ObjUpvalue
+
 typedef struct {
     int offset, line;
 } LineInfo;
@@ -83,5 +87,7 @@ void freeChunk(VM *vm, Chunk *chunk);
 void writeChunk(VM *vm, Chunk *chunk, uint8_t byte, int line);
 int addConst(VM *vm, Chunk *chunk, Value value);
 int getLine(Chunk *chunk, int instruction);
+// number of operand bytes of the instruction at `offset`
+int getArgCount(const Chunk *chunk, int offset);
 
 #endif // INCLUDE_CLOX_CHUNK_H_
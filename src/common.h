@@ -17,6 +17,7 @@
 // #define DEBUG_TRACE_EXECUTION
 #define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
+// #define DEBUG_VERIFY_GC
 
 #define UNREACHABLE()                                                          \
     do {                                                                       \
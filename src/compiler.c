@@ -21,12 +21,20 @@ typedef struct {
     bool hadError, panicMode;
     Token prv, cur;
     Lexer lexer;
+
+    // set when function bodies are compiled lazily
+    ObjString *source;
+    // skipping over a lazy body, locals still in their initializer
+    // can't be captured by it so they are ignored instead of an error
+    bool scanning;
 } Parser;
 
 static inline void initParser(Parser *p, const char *src) {
     initLexer(&p->lexer, src);
     p->hadError = false;
     p->panicMode = false;
+    p->source = NULL;
+    p->scanning = false;
 }
 
 typedef enum {
@@ -58,6 +66,8 @@ typedef struct {
     Token name;
     int depth;
     OpCode exitOP;
+    bool isAssigned; // reassigned anywhere, including by inner functions
+    int start;       // code offset of the declaration
 } Local;
 
 typedef struct {
@@ -105,6 +115,8 @@ typedef struct Compiler {
 
     // upvalue info
     Upvalue upvalues[UINT8_COUNT];
+    // the names of the upvalues when compiling a lazy body
+    ValueArray *lazyUpvalues;
 
     // scope info
     int scopeDepth;
@@ -232,10 +244,12 @@ static uint8_t makeConstant(Compiler *c, Value value) {
 
     // add constant
     // make sure not collected
+    HandleScope scope = openScope(vm);
     if (IS_OBJ(value)) pushRoot(vm, value);
     int constIdx = addConst(vm, curChunk(c), value);
+    writeBarrier(vm, (Obj *)c->fn);
     // its safe so can remove it from temp roots
-    if (IS_OBJ(value)) popRoot(vm);
+    closeScope(&scope);
 
     if (constIdx > UINT8_MAX) {
         error(c->parser, "Too many constants in on chunk");
@@ -260,22 +274,25 @@ static void patchJump(Compiler *c, int offset) {
     curChunk(c)->code[offset + 1] = jump & 0xff;
 }
 
+// `fn` is NULL unless we are compiling the body of an existing lazy function
 static void initCompiler(Compiler *compiler, Compiler *enclosing,
-                         Parser *parser, FunctionType type) {
+                         Parser *parser, FunctionType type, ObjFn *fn) {
     *compiler = (Compiler){0};
     compiler->parser = parser;
     compiler->enclosing = enclosing;
     compiler->currentClass = enclosing == NULL ? NULL : enclosing->currentClass;
     compiler->type = type;
-    compiler->fn = newFunction(vm);
+    compiler->fn = fn != NULL ? fn : newFunction(vm);
     current = compiler;
 
-    if (type != TYPE_SCRIPT) {
-        compiler->fn->name = copyString(vm, parser->prv.start, parser->prv.len);
+    if (fn == NULL && type != TYPE_SCRIPT) {
+        ObjString *name = copyString(vm, parser->prv.start, parser->prv.len);
+        __atomic_store_n(&compiler->fn->name, name, __ATOMIC_RELEASE);
+        writeBarrier(vm, (Obj *)compiler->fn);
     }
 
     Local *local = &compiler->locals[compiler->localCount++];
-    *local = (Local){{0}, 0, OP_POP};
+    *local = (Local){{0}, 0, OP_POP, false, 0};
     if (type != TYPE_FUNCTION) {
         local->name.start = "this";
         local->name.len = 4;
@@ -285,15 +302,24 @@ static void initCompiler(Compiler *compiler, Compiler *enclosing,
     }
 }
 
+static void resolveCapture(Compiler *c, Local *local);
+
 static ObjFn *endCompiler(Compiler *compiler) {
     (void)compiler;
     Compiler *compiler_ = current;
-
-    emitReturn(compiler_);
     ObjFn *fn = compiler_->fn;
+    // a skipped lazy body has no code yet
+    bool skipped = fn->lazy != NULL && compiler_->lazyUpvalues == NULL;
+
+    if (!skipped) emitReturn(compiler_);
+
+    // the function's own locals are never popped by endScope
+    for (int i = 0; i < compiler_->localCount; i++) {
+        resolveCapture(compiler_, &compiler_->locals[i]);
+    }
 
 #ifdef DEBUG_PRINT_CODE
-    if (!compiler_->parser->hadError) {
+    if (!compiler_->parser->hadError && !skipped) {
         disassembleChunk(curChunk(compiler_),
                          fn->name != NULL ? fn->name->chars : "<script>");
     }
@@ -312,72 +338,47 @@ static void endScope(Compiler *compiler) {
     while (compiler->localCount > 0 &&
            compiler->locals[compiler->localCount - 1].depth >
                compiler->scopeDepth) {
-        emitOp(compiler, compiler->locals[compiler->localCount - 1].exitOP);
+        Local *local = &compiler->locals[compiler->localCount - 1];
+        resolveCapture(compiler, local);
+        emitOp(compiler, local->exitOP);
         compiler->localCount--;
     }
 }
 
-static inline int getArgCount(const uint8_t *code, const ValueArray constants,
-                              const int ip) {
-    switch ((OpCode)code[ip]) {
-    case OP_NOP:
-    case OP_NIL:
-    case OP_TRUE:
-    case OP_FALSE:
-    case OP_POP:
-    case OP_EQUAL:
-    case OP_NOT_EQUAL:
-    case OP_GREATER:
-    case OP_GREATER_EQUAL:
-    case OP_LESS:
-    case OP_LESS_EQUAL:
-    case OP_ADD:
-    case OP_MOD:
-    case OP_SUBTRACT:
-    case OP_MULTIPLY:
-    case OP_DIVIDE:
-    case OP_NOT:
-    case OP_NEGATE:
-    case OP_CLOSE_UPVALUE:
-    case OP_RETURN:
-    case OP_PRINT:
-    case OP_INHERIT:
-    case OP_GET_INDEX:
-    case OP_SET_INDEX:     return 0;
-
-    case OP_SMALL_INT:
-    case OP_CONSTANT:
-    case OP_GET_PROPERTY:
-    case OP_SET_PROPERTY:
-    case OP_GET_LOCAL:
-    case OP_SET_LOCAL:
-    case OP_GET_GLOBAL:
-    case OP_SET_GLOBAL:
-    case OP_DEFINE_GLOBAL:
-    case OP_GET_UPVALUE:
-    case OP_SET_UPVALUE:
-    case OP_GET_SUPER:
-    case OP_METHOD:
-    case OP_BUILD_ARRAY:
-    case OP_BUILD_MAP:     return 1;
-
-    case OP_JUMP:
-    case OP_JUMP_IF_FALSE:
-    case OP_LOOP:
-    case OP_CLASS:
-    case OP_CALL:
-    case OP_INVOKE:
-    case OP_SUPER_INVOKE:  return 2;
-
-    case OP_CLOSURE: {
-        int constant = code[ip + 1];
-        ObjFn *loadedFn = AS_FUNCTION(constants.values[constant]);
-
-        // There is one byte for the constant, then two for each upvalue.
-        return 1 + (loadedFn->upvalueCnt * 2);
-    }
-    }
-    return 0;
+// called once a local's lifetime is over and we know if it was ever
+// reassigned. captures of locals that never change are copied straight into
+// the closure, the rest have to be shared through an ObjUpvalue, so flag
+// every OP_CLOSURE that captured it since it was declared
+static void resolveCapture(Compiler *c, Local *local) {
+    if (local->exitOP != OP_CLOSE_UPVALUE) return;
+    if (!local->isAssigned) {
+        local->exitOP = OP_POP;
+        return;
+    }
+
+    int slot = (int)(local - c->locals);
+    Chunk *chunk = curChunk(c);
+    int i = local->start;
+    while (i < chunk->cnt) {
+        if (chunk->code[i] == OP_NOP) {
+            // an unpatched 'break' still has its jump operand
+            i += 3;
+            continue;
+        }
+
+        if (chunk->code[i] == OP_CLOSURE) {
+            Value constant = chunk->constants.values[chunk->code[i + 1]];
+            ObjFn *fn = AS_FUNCTION(constant);
+            for (int j = 0; j < fn->upvalueCnt; j++) {
+                uint8_t *flags = &chunk->code[i + 2 + j * 2];
+                uint8_t index = chunk->code[i + 3 + j * 2];
+                if ((*flags & UPVALUE_LOCAL) && index == slot) {
+                    *flags |= UPVALUE_MUTABLE;
+                }
+            }
+        }
+        i += 1 + getArgCount(chunk, i);
+    }
 }
 
 static inline void initLoop(Compiler *c, Loop *loop) {
@@ -402,7 +403,7 @@ static void endLoop(Compiler *c, int loopStart) {
             patchJump(c, i + 1);
             i += 3;
         } else {
-            i += 1 + getArgCount(chunk->code, chunk->constants, i);
+            i += 1 + getArgCount(chunk, i);
         }
     }
 
@@ -435,6 +436,7 @@ static uint8_t identifierConst(Compiler *c, Token *name, IdentType type,
             return (uint8_t)AS_NUMBER(index);
         }
 
+        HandleScope scope = openScope(vm);
         pushRoot(vm, OBJ_VAL(ident));
 
         uint8_t newIndex = (uint8_t)vm->globalValues.cnt;
@@ -442,7 +444,7 @@ static uint8_t identifierConst(Compiler *c, Token *name, IdentType type,
         tableSet(vm, &vm->globalNames, OBJ_VAL(ident),
                  NUMBER_VAL((double)newIndex));
 
-        popRoot(vm);
+        closeScope(&scope);
 
         if (type == IDENT_CLASS_GLOBAL) {
             *classGlobal = newIndex;
@@ -463,6 +465,7 @@ static int resolveLocal(Compiler *compiler, Token *name) {
     for (int i = compiler->localCount - 1; i >= 0; i--) {
         Local *local = &compiler->locals[i];
         if (identifiersEqual(name, &local->name)) {
+            if (local->depth == -1 && compiler->parser->scanning) continue;
             if (local->depth == -1) {
                 error(compiler->parser,
                       "Can't read local variable in its own initializer");
@@ -494,8 +497,22 @@ static int addUpvalue(Compiler *compiler, uint8_t index, bool isLocal) {
     return compiler->fn->upvalueCnt++;
 }
 
+// the upvalues of a lazy body were resolved when it was scanned
+static int resolveLazyUpvalue(Compiler *compiler, Token *name) {
+    if (compiler->lazyUpvalues == NULL) return -1;
+
+    for (int i = 0; i < compiler->lazyUpvalues->cnt; i++) {
+        ObjString *upvalue = AS_STRING(compiler->lazyUpvalues->values[i]);
+        if (upvalue->length == name->len &&
+            memcmp(upvalue->chars, name->start, name->len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
 static int resolveUpvalue(Compiler *compiler, Token *name) {
-    if (compiler->enclosing == NULL) return -1;
+    if (compiler->enclosing == NULL) return resolveLazyUpvalue(compiler, name);
 
     int local = resolveLocal(compiler->enclosing, name);
     if (local != -1) {
@@ -511,13 +528,26 @@ static int resolveUpvalue(Compiler *compiler, Token *name) {
     return -1;
 }
 
+static void markUpvalueAssigned(Compiler *compiler, int index) {
+    // a lazy body's captures were already flagged when it was scanned
+    if (compiler->enclosing == NULL) return;
+
+    Upvalue *upvalue = &compiler->upvalues[index];
+    if (upvalue->isLocal) {
+        compiler->enclosing->locals[upvalue->index].isAssigned = true;
+    } else {
+        markUpvalueAssigned(compiler->enclosing, upvalue->index);
+    }
+}
+
 static int addLocal(Compiler *c, const Token name) {
     if (c->localCount == UINT8_COUNT) {
         error(c->parser, "Too many local variables in function");
         return -1;
     }
 
-    c->locals[c->localCount++] = (Local){name, -1, OP_POP};
+    c->locals[c->localCount++] =
+        (Local){name, -1, OP_POP, false, curChunk(c)->cnt};
     return c->localCount - 1;
 }
 
@@ -770,6 +800,11 @@ static void namedVariable(Compiler *c, Token name, bool canAssign) {
     if (canAssign && match(c, TOKEN_EQ)) {
         expression(c);
         emitOpArg(c, setOp, argIdx);
+        if (setOp == OP_SET_LOCAL) {
+            c->locals[argIdx].isAssigned = true;
+        } else if (setOp == OP_SET_UPVALUE) {
+            markUpvalueAssigned(c, argIdx);
+        }
     } else {
         emitOpArg(c, getOp, argIdx);
     }
@@ -939,28 +974,108 @@ static void block(Compiler *c) {
     consume(c, TOKEN_RBRACE, "Expect '}' after block");
 }
 
+static void parameters(Compiler *c) {
+    consume(c, TOKEN_LPAREN, "Expect '(' after function name");
+    if (!check(c, TOKEN_RPAREN)) {
+        do {
+            c->fn->arity++;
+            if (c->fn->arity > 255) {
+                errorAtCurrent(c->parser,
+                               "Can't have more than 255 parameters");
+            }
+            uint8_t constIdx = parseVariable(c, "Expect parameter name");
+            defineVariable(c, constIdx);
+        } while (match(c, TOKEN_COMMA));
+    }
+    consume(c, TOKEN_RPAREN, "Expect ')' after parameters");
+}
+
+static void captureName(Compiler *c, Token *name, bool isAssigned) {
+    // parameters shadow anything from the enclosing functions
+    if (resolveLocal(c, name) != -1) return;
+
+    int upvalue = resolveUpvalue(c, name);
+    if (upvalue == -1) return; // a global
+
+    ValueArray *names = &c->fn->lazy->upvalueNames;
+    if (upvalue == names->cnt) {
+        HANDLE_SCOPE(vm);
+        ObjString *ident = copyString(vm, name->start, name->len);
+        pushRoot(vm, OBJ_VAL(ident));
+        writeValueArray(vm, names, OBJ_VAL(ident));
+        writeBarrier(vm, (Obj *)c->fn);
+    }
+    if (isAssigned) markUpvalueAssigned(c, upvalue);
+}
+
+// records where the body is and skips to its end. every name used in the
+// body, including inside nested functions, that resolves to a variable of
+// an enclosing function is captured, this may capture more than the body
+// needs, but never less. the same goes for flagging captures as reassigned
+static void skipBody(Compiler *c) {
+    Parser *parser = c->parser;
+    LazyBody *lazy = ALLOCATE(LazyBody, 1);
+    *lazy = (LazyBody){
+        .source = parser->source,
+        .start = parser->cur.start,
+        .line = parser->cur.line,
+        .type = c->type,
+        .inClass = c->currentClass != NULL,
+        .hasSuperClass = c->currentClass != NULL &&
+                         c->currentClass->hasSuperClass,
+    };
+    initValueArray(&lazy->upvalueNames);
+    __atomic_store_n(&c->fn->lazy, lazy, __ATOMIC_RELEASE);
+    writeBarrier(vm, (Obj *)c->fn);
+
+    parameters(c);
+    consume(c, TOKEN_LBRACE, "Expect '{' before function body");
+
+    parser->scanning = true;
+    int depth = 1;
+    while (depth > 0 && !check(c, TOKEN_EOF)) {
+        advance(parser);
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wswitch-enum"
+        switch (parser->prv.type) {
+        case TOKEN_LBRACE: depth++; break;
+        case TOKEN_RBRACE: depth--; break;
+        case TOKEN_DOT:
+            // property names aren't variables
+            if (check(c, TOKEN_IDENTIFIER)) advance(parser);
+            break;
+        case TOKEN_SUPER: {
+            // `super` calls also need the receiver
+            Token this_ = syntheticToken("this", 4);
+            captureName(c, &this_, false);
+            captureName(c, &parser->prv, false);
+        } break;
+        case TOKEN_IDENTIFIER:
+        case TOKEN_THIS:
+            captureName(c, &parser->prv, check(c, TOKEN_EQ));
+            break;
+        default: break;
+        }
+#pragma GCC diagnostic pop
+    }
+    parser->scanning = false;
+
+    if (depth > 0) error(parser, "Expect '}' after block");
+}
+
 static void function(Compiler *c, FunctionType type) {
     (void)c;
     Compiler compiler = {0};
-    initCompiler(&compiler, current, current->parser, type);
+    initCompiler(&compiler, current, current->parser, type, NULL);
     beginScope(current);
 
-    consume(&compiler, TOKEN_LPAREN, "Expect '(' after function name");
-    if (!check(&compiler, TOKEN_RPAREN)) {
-        do {
-            compiler.fn->arity++;
-            if (compiler.fn->arity > 255) {
-                errorAtCurrent(c->parser,
-                               "Can't have more than 255 parameters");
-            }
-            uint8_t constIdx =
-                parseVariable(&compiler, "Expect parameter name");
-            defineVariable(&compiler, constIdx);
-        } while (match(&compiler, TOKEN_COMMA));
+    if (compiler.parser->source != NULL) {
+        skipBody(&compiler);
+    } else {
+        parameters(&compiler);
+        consume(&compiler, TOKEN_LBRACE, "Expect '{' before function body");
+        block(&compiler);
     }
-    consume(&compiler, TOKEN_RPAREN, "Expect ')' after parameters");
-    consume(&compiler, TOKEN_LBRACE, "Expect '{' before function body");
-    block(&compiler);
 
     // don't need to call endScope as endCompiler
     // closes the scope implicitly
@@ -968,11 +1083,10 @@ static void function(Compiler *c, FunctionType type) {
     emitOpArg(current, OP_CLOSURE, makeConstant(current, OBJ_VAL(function)));
 
     for (int i = 0; i < function->upvalueCnt; i++) {
-        // true is represented as uint8_t 1
-        // false is represented as uint8_t 0
-        // so we can just write it straight
+        // UPVALUE_MUTABLE gets patched in by resolveCapture once we know
+        // if the captured local is ever reassigned
         Upvalue upv = compiler.upvalues[i];
-        emitBytes(current, upv.isLocal, upv.index);
+        emitBytes(current, upv.isLocal ? UPVALUE_LOCAL : 0, upv.index);
     }
 }
 
@@ -1173,6 +1287,7 @@ static inline bool forIterStmt(Compiler *c) {
     int iSlot = addLocal(c, first);
     defineVariable(c, 1);
     emitOp(c, OP_NIL);
+    c->locals[iSlot].isAssigned = true; // updated every iteration
 
     // add `ix`and initialize it if we need it
     int ixSlot = -1;
@@ -1180,6 +1295,7 @@ static inline bool forIterStmt(Compiler *c) {
         ixSlot = addLocal(c, second);
         defineVariable(c, 2);
         emitOp(c, OP_NIL);
+        c->locals[ixSlot].isAssigned = true;
     }
 
     // compile the loop body
@@ -1434,8 +1550,17 @@ ObjFn *compile(VM *vm_, const char *source) {
     vm = vm_;
     Parser parser = {0};
     initParser(&parser, source);
+    HandleScope scope = openScope(vm);
+    if (vm->lazyCompile) {
+        // lazy bodies point into the source so it has to outlive the caller's
+        parser.source = copyString(vm, source, (int)strlen(source));
+        initLexer(&parser.lexer, parser.source->chars);
+        pushRoot(vm, OBJ_VAL(parser.source));
+    }
     Compiler compiler = {0};
-    initCompiler(&compiler, current, &parser, TYPE_SCRIPT);
+    initCompiler(&compiler, current, &parser, TYPE_SCRIPT, NULL);
+    // the compiler roots keep the source alive from here on
+    closeScope(&scope);
 
     advance(&parser);
 
@@ -1448,7 +1573,42 @@ ObjFn *compile(VM *vm_, const char *source) {
     return parser.hadError ? NULL : function;
 }
 
+bool compileLazy(VM *vm_, ObjFn *fn) {
+    vm = vm_;
+    LazyBody *lazy = fn->lazy;
+    Parser parser = {0};
+    initParser(&parser, lazy->start);
+    parser.lexer.line = lazy->line;
+    parser.source = lazy->source;
+
+    ClassCompiler klass = {NULL, lazy->hasSuperClass};
+    Compiler compiler = {0};
+    initCompiler(&compiler, NULL, &parser, (FunctionType)lazy->type, fn);
+    compiler.currentClass = lazy->inClass ? &klass : NULL;
+    compiler.lazyUpvalues = &lazy->upvalueNames;
+    beginScope(&compiler);
+
+    // `lazy` stays attached until the body is done so its names stay alive
+    advance(&parser);
+    fn->arity = 0;
+    parameters(&compiler);
+    consume(&compiler, TOKEN_LBRACE, "Expect '{' before function body");
+    block(&compiler);
+    endCompiler(&compiler);
+    vm = NULL;
+
+    if (parser.hadError) {
+        freeChunk(vm_, &fn->chunk);
+        return false;
+    }
+
+    freeLazyBody(vm_, fn);
+    return true;
+}
+
 void markCompilerRoots(VM *vm) {
+    if (current != NULL) markObject(vm, (Obj *)current->parser->source);
+
     Compiler *compiler = current;
     while (compiler != NULL) {
         markObject(vm, (Obj *)compiler->fn);
@@ -5,6 +5,7 @@
 #include "vm.h"
 
 ObjFn *compile(VM *vm, const char *source);
+bool compileLazy(VM *vm, ObjFn *fn);
 void markCompilerRoots(VM *vm);
 
 #endif // INCLUDE_CLOX_COMPILER_H_
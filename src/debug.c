@@ -108,10 +108,11 @@ int disassembleInst(Chunk *chunk, int offset) {
 
         ObjFn *function = AS_FUNCTION(chunk->constants.values[idx]);
         for (int j = 0; j < function->upvalueCnt; j++) {
-            int isLocal = chunk->code[offset++];
+            int flags = chunk->code[offset++];
             int index = chunk->code[offset++];
-            printf("%04d      |                     %s %d\n", offset - 2,
-                   isLocal ? "local" : "upvalue", index);
+            printf("%04d      |                     %s %d%s\n", offset - 2,
+                   (flags & UPVALUE_LOCAL) ? "local" : "upvalue", index,
+                   (flags & UPVALUE_MUTABLE) ? " (mutable)" : "");
         }
         return offset;
     }
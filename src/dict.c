@@ -0,0 +1,213 @@
+#include <string.h>
+
+#include "dict.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+
+#define DICT_MIN_CAP 8
+// an insert that probes further than this has the slots salted, as in Table
+#define DICT_MAX_PROBE 64
+
+// what a slot holds instead of the index of an entry
+#define SLOT_EMPTY   -1
+#define SLOT_DELETED -2
+
+void initDict(Dict *dict) { *dict = (Dict){0}; }
+
+// the entries there is room for with `cap` slots. at most two thirds of the
+// slots are ever taken, so a probe always ends
+static inline int usableOf(int cap) { return cap * 2 / 3; }
+
+// the bytes a slot takes, just enough for the index of any entry
+static inline size_t slotWidth(int cap) {
+    if (cap <= 128) return sizeof(int8_t);
+    if (cap <= 32768) return sizeof(int16_t);
+    return sizeof(int32_t);
+}
+
+static inline size_t slotBytes(int cap) { return slotWidth(cap) * cap; }
+
+// the head, the entries and then the slots
+static inline size_t dictBytes(int cap) {
+    if (cap == 0) return 0;
+    return sizeof(DictHead) + sizeof(Entry) * usableOf(cap) + slotBytes(cap);
+}
+
+static inline void *slotsOf(Dict *dict) {
+    return dict->entries + usableOf(dict->cap);
+}
+
+static inline int slotAt(Dict *dict, size_t slot) {
+    void *slots = slotsOf(dict);
+    switch (slotWidth(dict->cap)) {
+    case sizeof(int8_t):  return ((int8_t *)slots)[slot];
+    case sizeof(int16_t): return ((int16_t *)slots)[slot];
+    default:              return ((int32_t *)slots)[slot];
+    }
+}
+
+static inline void setSlot(Dict *dict, size_t slot, int idx) {
+    void *slots = slotsOf(dict);
+    switch (slotWidth(dict->cap)) {
+    case sizeof(int8_t):  ((int8_t *)slots)[slot] = (int8_t)idx; break;
+    case sizeof(int16_t): ((int16_t *)slots)[slot] = (int16_t)idx; break;
+    default:              ((int32_t *)slots)[slot] = (int32_t)idx; break;
+    }
+}
+
+void freeDict(VM *vm, Dict *dict) {
+    if (dict->entries != NULL) {
+        reallocateBuffer(vm, dictHead(dict), dictBytes(dict->cap), 0);
+    }
+    initDict(dict);
+}
+
+// the slot that holds where `key` is, or -1
+static int findSlot(Dict *dict, Value key, uint32_t hash) {
+    size_t mask = (size_t)dict->cap - 1;
+    size_t slot = homeOf(hash, dictHead(dict)->salt) & mask;
+    for (;;) {
+        int idx = slotAt(dict, slot);
+        if (idx == SLOT_EMPTY) return -1;
+        if (idx >= 0 && valuesEqual(dict->entries[idx].key, key)) {
+            return (int)slot;
+        }
+        slot = (slot + 1) & mask;
+    }
+}
+
+// the first slot a key with `hash` that is not in the dict yet can take,
+// and how far it is from where the probe started
+static int findFree(Dict *dict, uint32_t hash, uint32_t *dist) {
+    size_t mask = (size_t)dict->cap - 1;
+    size_t slot = homeOf(hash, dictHead(dict)->salt) & mask;
+    for (*dist = 0; slotAt(dict, slot) >= 0; (*dist)++) {
+        slot = (slot + 1) & mask;
+    }
+    return (int)slot;
+}
+
+// fills the slots in from the entries, which also drops the deleted ones
+static void reindex(Dict *dict) {
+    memset(slotsOf(dict), 0xff, slotBytes(dict->cap));
+    int used = dictHead(dict)->used;
+    for (int i = 0; i < used; i++) {
+        Value key = dict->entries[i].key;
+        if (IS_EMPTY(key)) continue;
+        uint32_t dist;
+        setSlot(dict, findFree(dict, hashValue(key), &dist), i);
+    }
+}
+
+// packs the entries into a new buffer with `cap` slots
+static void resize(VM *vm, Dict *dict, int cap) {
+    DictHead *head = (DictHead *)reallocateBuffer(vm, NULL, 0, dictBytes(cap));
+    Entry *entries = (Entry *)(head + 1);
+    int used = 0;
+    for (int i = 0; i < dictUsed(dict); i++) {
+        if (!IS_EMPTY(dict->entries[i].key)) entries[used++] = dict->entries[i];
+    }
+    for (int i = used; i < usableOf(cap); i++) {
+        entries[i] = (Entry){EMPTY_VAL, NIL_VAL};
+    }
+    *head = (DictHead){used, dict->entries == NULL ? 0 : dictHead(dict)->salt};
+
+    // a marking thread reads the used count from the buffer it finds, so
+    // the old one stays as it is until it is freed
+    if (dict->entries != NULL) {
+        reallocateBuffer(vm, dictHead(dict), dictBytes(dict->cap), 0);
+    }
+    __atomic_store_n(&dict->entries, entries, __ATOMIC_RELEASE);
+    dict->cap = cap;
+    reindex(dict);
+}
+
+bool dictGet(Dict *dict, Value key, Value *value) {
+    if (dict->cnt == 0) return false;
+
+    int slot = findSlot(dict, key, hashValue(key));
+    if (slot < 0) return false;
+
+    *value = dict->entries[slotAt(dict, slot)].value;
+    return true;
+}
+
+bool dictSet(VM *vm, Dict *dict, Value key, Value value) {
+    uint32_t hash = hashValue(key);
+    if (dict->cnt > 0) {
+        int slot = findSlot(dict, key, hash);
+        if (slot >= 0) {
+            storeValue(&dict->entries[slotAt(dict, slot)].value, value);
+            return false;
+        }
+    }
+
+    if (dictUsed(dict) == usableOf(dict->cap)) {
+        // mostly deleted entries only need packing
+        int cap = dict->cap;
+        if (cap == 0) {
+            cap = DICT_MIN_CAP;
+        } else if (dict->cnt + 1 > usableOf(cap) / 2) {
+            cap = GROW_CAP(cap);
+        }
+        resize(vm, dict, cap);
+    }
+
+    DictHead *head = dictHead(dict);
+    uint32_t dist;
+    int slot = findFree(dict, hash, &dist);
+    int idx = head->used;
+    storeValue(&dict->entries[idx].key, key);
+    storeValue(&dict->entries[idx].value, value);
+    setSlot(dict, slot, idx);
+    __atomic_store_n(&head->used, idx + 1, __ATOMIC_RELEASE);
+    dict->cnt++;
+
+    if (dist > DICT_MAX_PROBE && head->salt == 0) {
+        head->salt = newSalt();
+        reindex(dict);
+    }
+    return true;
+}
+
+bool dictDelete(Dict *dict, Value key) {
+    if (dict->cnt == 0) return false;
+
+    int slot = findSlot(dict, key, hashValue(key));
+    if (slot < 0) return false;
+
+    Entry *entry = &dict->entries[slotAt(dict, slot)];
+    storeValue(&entry->key, EMPTY_VAL);
+    storeValue(&entry->value, NIL_VAL);
+    setSlot(dict, slot, SLOT_DELETED);
+    dict->cnt--;
+    return true;
+}
+
+void dictClear(Dict *dict) {
+    if (dict->cap == 0) return;
+    DictHead *head = dictHead(dict);
+    for (int i = 0; i < head->used; i++) {
+        storeValue(&dict->entries[i].key, EMPTY_VAL);
+        storeValue(&dict->entries[i].value, NIL_VAL);
+    }
+    memset(slotsOf(dict), 0xff, slotBytes(dict->cap));
+    __atomic_store_n(&head->used, 0, __ATOMIC_RELAXED);
+    dict->cnt = 0;
+}
+
+int markDict(VM *vm, Dict *dict) {
+    // the buffer can be swapped for a packed one on another thread, the old
+    // one is kept around with its count as it was
+    Entry *entries = __atomic_load_n(&dict->entries, __ATOMIC_ACQUIRE);
+    if (entries == NULL) return 0;
+
+    int used = __atomic_load_n(&((DictHead *)entries - 1)->used,
+                               __ATOMIC_ACQUIRE);
+    for (int i = 0; i < used; i++) {
+        markValue(vm, loadValue(&entries[i].key));
+        markValue(vm, loadValue(&entries[i].value));
+    }
+    return used;
+}
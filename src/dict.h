@@ -0,0 +1,52 @@
+#ifndef INCLUDE_CLOX_DICT_H_
+#define INCLUDE_CLOX_DICT_H_
+
+#include "common.h"
+#include "table.h"
+#include "value.h"
+
+// the table maps are kept in, which remembers the order keys were added in.
+// the entries are appended to a dense array, and the hash slots after it
+// only hold where in it a key is, in 1, 2 or 4 bytes depending on how many
+// slots there are. a deleted key leaves an empty key in its entry until the
+// entries are packed again, so walking them in order costs about as much as
+// the count
+typedef struct {
+    // the keys in the map
+    int cnt;
+    // the number of slots, a power of two
+    int cap;
+    // preceded by a DictHead, and NULL while there are no slots
+    Entry *entries;
+} Dict;
+
+// the start of the buffer of a dict
+typedef struct {
+    // the entries taken, deleted ones included
+    int used;
+    // 0 until an insert had to probe too far, as with Table
+    uint32_t salt;
+} DictHead;
+
+typedef struct VM VM;
+
+static inline DictHead *dictHead(const Dict *dict) {
+    return (DictHead *)dict->entries - 1;
+}
+
+// the entries there are to walk, deleted ones included
+static inline int dictUsed(const Dict *dict) {
+    return dict->entries == NULL ? 0 : dictHead(dict)->used;
+}
+
+void initDict(Dict *dict);
+void freeDict(VM *vm, Dict *dict);
+bool dictGet(Dict *dict, Value key, Value *value);
+// returns whether `key` is new
+bool dictSet(VM *vm, Dict *dict, Value key, Value value);
+bool dictDelete(Dict *dict, Value key);
+void dictClear(Dict *dict);
+// returns the number of entries it looked at
+int markDict(VM *vm, Dict *dict);
+
+#endif // INCLUDE_CLOX_DICT_H_
@@ -0,0 +1,764 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "chunk.h"
+#include "common.h"
+#include "compiler.h"
+#include "image.h"
+#include "memory.h"
+#include "natives.h"
+#include "object.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+
+#define IMAGE_MAGIC   "LOXI"
+#define VERSION_STAMP ((uint32_t)(IMAGE_VERSION << 8 | OP_CLOSURE))
+#define NO_OBJ        UINT32_MAX
+#define NAME_MAX_LEN  64
+
+// an image is an ImageHeader followed by one record per object, in id order
+//   uint32_t type, uint32_t size of the fields, fields
+// then what each weak object holds, in id order, as only then is it known
+// which of its objects the image has
+//   weak ref: target, nil if the target is not saved
+//   weak map: uint32_t cnt, (key, value) pairs whose key is saved
+// and then the globals
+//   uint32_t cnt, (name, index) pairs of globalNames
+//   uint32_t cnt, values of globalValues
+// pointers are stored as object ids and relocated when the image is loaded
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t objCnt;
+} ImageHeader;
+
+typedef enum {
+    IMAGE_NIL,
+    IMAGE_BOOL,
+    IMAGE_NUMBER,
+    IMAGE_EMPTY,
+    IMAGE_OBJ,
+} ImageValueType;
+
+typedef struct {
+    Obj *obj;
+    uint32_t id;
+} IdEntry;
+
+typedef struct {
+    VM *vm;
+    uint8_t *bytes;
+    size_t cnt, cap;
+
+    // every object that has an id, in id order. the ones after the object
+    // being written still have to be written
+    Obj **objs;
+    uint32_t objCnt, objCap;
+
+    IdEntry *ids; // open addressing, object -> id
+    uint32_t idCap;
+} ImageWriter;
+
+static void emitBytes(ImageWriter *w, const void *bytes, size_t size) {
+    while (w->cap < w->cnt + size) {
+        w->cap = GROW_CAP(w->cap);
+        w->bytes = (uint8_t *)realloc(w->bytes, w->cap);
+        if (w->bytes == NULL) exit(1);
+    }
+    memcpy(w->bytes + w->cnt, bytes, size);
+    w->cnt += size;
+}
+
+static void emitU32(ImageWriter *w, uint32_t n) {
+    emitBytes(w, &n, sizeof(n));
+}
+
+static void emitDouble(ImageWriter *w, double n) {
+    emitBytes(w, &n, sizeof(n));
+}
+
+static inline uint32_t hashPtr(const Obj *obj) {
+    return (uint32_t)(((uintptr_t)obj >> 3) * 2654435761u);
+}
+
+static IdEntry *findId(IdEntry *ids, uint32_t cap, const Obj *obj) {
+    uint32_t idx = hashPtr(obj) & (cap - 1);
+    while (ids[idx].obj != NULL && ids[idx].obj != obj) {
+        idx = (idx + 1) & (cap - 1);
+    }
+    return &ids[idx];
+}
+
+// whether `obj` is saved, without giving it an id
+static bool hasId(ImageWriter *w, Obj *obj) {
+    return w->idCap > 0 && findId(w->ids, w->idCap, obj)->obj != NULL;
+}
+
+static uint32_t objectId(ImageWriter *w, Obj *obj) {
+    if (obj == NULL) return NO_OBJ;
+
+    if ((w->objCnt + 1) * 4 > w->idCap * 3) {
+        uint32_t cap = w->idCap == 0 ? 64 : w->idCap * 2;
+        IdEntry *ids = (IdEntry *)calloc(cap, sizeof(IdEntry));
+        if (ids == NULL) exit(1);
+        for (uint32_t i = 0; i < w->idCap; i++) {
+            if (w->ids[i].obj != NULL) {
+                *findId(ids, cap, w->ids[i].obj) = w->ids[i];
+            }
+        }
+        free(w->ids);
+        w->ids = ids;
+        w->idCap = cap;
+    }
+
+    IdEntry *entry = findId(w->ids, w->idCap, obj);
+    if (entry->obj != NULL) return entry->id;
+
+    if (w->objCap < w->objCnt + 1) {
+        w->objCap = GROW_CAP(w->objCap);
+        w->objs = (Obj **)realloc(w->objs, sizeof(Obj *) * w->objCap);
+        if (w->objs == NULL) exit(1);
+    }
+    w->objs[w->objCnt] = obj;
+    *entry = (IdEntry){obj, w->objCnt};
+    return w->objCnt++;
+}
+
+static void emitValue(ImageWriter *w, Value value) {
+    if (IS_OBJ(value)) {
+        emitU32(w, IMAGE_OBJ);
+        emitU32(w, objectId(w, AS_OBJ(value)));
+    } else if (IS_NUMBER(value)) {
+        emitU32(w, IMAGE_NUMBER);
+        emitDouble(w, AS_NUMBER(value));
+    } else if (IS_BOOL(value)) {
+        emitU32(w, IMAGE_BOOL);
+        emitU32(w, AS_BOOL(value));
+    } else if (IS_EMPTY(value)) {
+        emitU32(w, IMAGE_EMPTY);
+    } else {
+        emitU32(w, IMAGE_NIL);
+    }
+}
+
+static void emitValues(ImageWriter *w, ValueArray *array) {
+    emitU32(w, (uint32_t)array->cnt);
+    for (int i = 0; i < array->cnt; i++) {
+        emitValue(w, array->values[i]);
+    }
+}
+
+// only the entries are kept, keys hashed by address get rehashed on load
+static void emitTable(ImageWriter *w, Table *table) {
+    uint32_t cnt = 0;
+    for (int i = 0; i < table->cap; i++) {
+        if (!IS_EMPTY(table->entries[i].key)) cnt++;
+    }
+
+    emitU32(w, cnt);
+    for (int i = 0; i < table->cap; i++) {
+        Entry *entry = &table->entries[i];
+        if (IS_EMPTY(entry->key)) continue;
+        emitValue(w, entry->key);
+        emitValue(w, entry->value);
+    }
+}
+
+// maps keep their keys in order
+static void emitDict(ImageWriter *w, Dict *dict) {
+    emitU32(w, (uint32_t)dict->cnt);
+    for (int i = 0; i < dictUsed(dict); i++) {
+        Entry *entry = &dict->entries[i];
+        if (IS_EMPTY(entry->key)) continue;
+        emitValue(w, entry->key);
+        emitValue(w, entry->value);
+    }
+}
+
+static bool emitFunction(ImageWriter *w, ObjFn *fn) {
+    // lazy and cached bodies are not part of the heap yet
+    if (fn->cached != NULL) loadCachedBody(w->vm, fn);
+    if (fn->lazy != NULL && !compileLazy(w->vm, fn)) return false;
+
+    Chunk *chunk = &fn->chunk;
+    emitU32(w, (uint32_t)fn->arity);
+    emitU32(w, (uint32_t)fn->upvalueCnt);
+    emitU32(w, objectId(w, (Obj *)fn->name));
+
+    emitU32(w, (uint32_t)chunk->cnt);
+    emitBytes(w, chunk->code, chunk->cnt);
+    emitU32(w, (uint32_t)chunk->lineCnt);
+    for (int i = 0; i < chunk->lineCnt; i++) {
+        emitU32(w, (uint32_t)chunk->lines[i].offset);
+        emitU32(w, (uint32_t)chunk->lines[i].line);
+    }
+    emitValues(w, &chunk->constants);
+    return true;
+}
+
+static bool emitObject(ImageWriter *w, Obj *obj) {
+    emitU32(w, obj->type);
+    size_t sizeAt = w->cnt;
+    emitU32(w, 0);
+
+    switch (obj->type) {
+    case OBJ_STRING: {
+        ObjString *string = (ObjString *)obj;
+        emitU32(w, (uint32_t)string->length);
+        emitBytes(w, string->chars, string->length);
+    } break;
+    case OBJ_FUNCTION: {
+        if (!emitFunction(w, (ObjFn *)obj)) return false;
+    } break;
+    case OBJ_NATIVE: {
+        char name[NAME_MAX_LEN];
+        NativeFn fn = ((ObjNative *)obj)->function;
+        int len = nativeName(fn, name, sizeof(name));
+        if (len < 0 || len >= NAME_MAX_LEN) return false;
+        emitU32(w, (uint32_t)len);
+        emitBytes(w, name, len);
+    } break;
+    case OBJ_CLOSURE: {
+        ObjClosure *closure = (ObjClosure *)obj;
+        emitU32(w, objectId(w, (Obj *)closure->fn));
+        for (int i = 0; i < closure->upvalueCnt; i++) {
+            emitValue(w, closure->upvalues[i]);
+        }
+    } break;
+    case OBJ_UPVALUE: {
+        // upvalues of finished frames are closed, open ones are saved as
+        // they are right now
+        emitValue(w, *((ObjUpvalue *)obj)->location);
+    } break;
+    case OBJ_CLASS: {
+        ObjClass *klass = (ObjClass *)obj;
+        emitU32(w, objectId(w, (Obj *)klass->name));
+        emitTable(w, &klass->methods);
+    } break;
+    case OBJ_INSTANCE: {
+        ObjInstance *instance = (ObjInstance *)obj;
+        emitU32(w, objectId(w, (Obj *)instance->klass));
+        emitTable(w, &instance->fields);
+    } break;
+    case OBJ_BOUND_METHOD: {
+        ObjBoundMethod *bound = (ObjBoundMethod *)obj;
+        emitU32(w, objectId(w, (Obj *)bound->method));
+        emitValue(w, bound->receiver);
+    } break;
+    case OBJ_ERROR: {
+        ObjError *error = (ObjError *)obj;
+        emitU32(w, objectId(w, (Obj *)error->msg));
+        emitU32(w, error->recoverable);
+    } break;
+    case OBJ_ARRAY: emitValues(w, &((ObjArray *)obj)->items); break;
+    case OBJ_MAP:   emitDict(w, &((ObjMap *)obj)->items); break;
+    // what weak ones hold is written once every saved object has an id
+    case OBJ_WEAK_MAP:
+    case OBJ_WEAK_REF: break;
+    case OBJ_RANGE: {
+        ObjRange *range = (ObjRange *)obj;
+        emitDouble(w, range->start);
+        emitDouble(w, range->stop);
+        emitDouble(w, range->step);
+    } break;
+    }
+
+    uint32_t size = (uint32_t)(w->cnt - sizeAt - sizeof(uint32_t));
+    memcpy(w->bytes + sizeAt, &size, sizeof(size));
+    return true;
+}
+
+// gives ids to the values of weak map entries whose key has one, as the
+// key keeps them alive. returns whether any were new
+static bool keepEphemerons(ImageWriter *w) {
+    uint32_t before = w->objCnt;
+    for (uint32_t i = 0; i < w->objCnt; i++) {
+        if (w->objs[i]->type != OBJ_WEAK_MAP) continue;
+        Table *items = &((ObjWeakMap *)w->objs[i])->items;
+        for (int j = 0; j < items->cap; j++) {
+            Entry *entry = &items->entries[j];
+            if (IS_EMPTY(entry->key) || !hasId(w, AS_OBJ(entry->key))) continue;
+            if (IS_OBJ(entry->value)) objectId(w, AS_OBJ(entry->value));
+        }
+    }
+    return w->objCnt > before;
+}
+
+// weak objects keep what is saved anyway, and lose the rest
+static void emitWeak(ImageWriter *w) {
+    for (uint32_t i = 0; i < w->objCnt; i++) {
+        Obj *obj = w->objs[i];
+        if (obj->type == OBJ_WEAK_REF) {
+            Value target = ((ObjWeakRef *)obj)->target;
+            bool saved = IS_OBJ(target) && hasId(w, AS_OBJ(target));
+            emitValue(w, saved ? target : NIL_VAL);
+        } else if (obj->type == OBJ_WEAK_MAP) {
+            Table *items = &((ObjWeakMap *)obj)->items;
+            uint32_t cnt = 0;
+            for (int j = 0; j < items->cap; j++) {
+                Value key = items->entries[j].key;
+                if (!IS_EMPTY(key) && hasId(w, AS_OBJ(key))) cnt++;
+            }
+
+            emitU32(w, cnt);
+            for (int j = 0; j < items->cap; j++) {
+                Entry *entry = &items->entries[j];
+                if (IS_EMPTY(entry->key) || !hasId(w, AS_OBJ(entry->key))) {
+                    continue;
+                }
+                emitValue(w, entry->key);
+                emitValue(w, entry->value);
+            }
+        }
+    }
+}
+
+static void freeWriter(ImageWriter *w) {
+    free(w->bytes);
+    free(w->objs);
+    free(w->ids);
+}
+
+bool saveImage(VM *vm, const char *path) {
+    ImageWriter w = {0};
+    w.vm = vm;
+
+    ImageHeader header = {0};
+    emitBytes(&w, &header, sizeof(header));
+
+    // the globals are the only roots once a script has finished
+    for (int i = 0; i < vm->globalNames.cap; i++) {
+        Entry *entry = &vm->globalNames.entries[i];
+        if (!IS_EMPTY(entry->key)) objectId(&w, AS_OBJ(entry->key));
+    }
+    for (int i = 0; i < vm->globalValues.cnt; i++) {
+        Value value = vm->globalValues.values[i];
+        if (IS_OBJ(value)) objectId(&w, AS_OBJ(value));
+    }
+
+    // the values of weak maps are only saved once their keys are, which can
+    // take a few rounds
+    uint32_t emitted = 0;
+    do {
+        for (; emitted < w.objCnt; emitted++) {
+            if (!emitObject(&w, w.objs[emitted])) {
+                fprintf(stderr, "Can't save a %s in an image\n",
+                        ObjTypeString(w.objs[emitted]->type));
+                freeWriter(&w);
+                return false;
+            }
+        }
+    } while (keepEphemerons(&w));
+
+    emitWeak(&w);
+    emitTable(&w, &vm->globalNames);
+    emitValues(&w, &vm->globalValues);
+
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    header.version = VERSION_STAMP;
+    header.objCnt = w.objCnt;
+    memcpy(w.bytes, &header, sizeof(header));
+
+    FILE *f = fopen(path, "wb");
+    bool ok = f != NULL && fwrite(w.bytes, 1, w.cnt, f) == w.cnt;
+    if (f != NULL && fclose(f) != 0) ok = false;
+
+    freeWriter(&w);
+    return ok;
+}
+
+typedef struct {
+    const uint8_t *at;
+    const uint8_t *end;
+    bool ok;
+} Reader;
+
+typedef struct {
+    VM *vm;
+    Obj **objs; // indexed by id
+    uint32_t objCnt;
+} Loader;
+
+static const uint8_t *readBytes(Reader *r, size_t size) {
+    if (!r->ok || (size_t)(r->end - r->at) < size) {
+        r->ok = false;
+        return NULL;
+    }
+    const uint8_t *bytes = r->at;
+    r->at += size;
+    return bytes;
+}
+
+static uint32_t readU32(Reader *r) {
+    uint32_t n = 0;
+    const uint8_t *bytes = readBytes(r, sizeof(n));
+    if (bytes != NULL) memcpy(&n, bytes, sizeof(n));
+    return n;
+}
+
+static double readDouble(Reader *r) {
+    double n = 0;
+    const uint8_t *bytes = readBytes(r, sizeof(n));
+    if (bytes != NULL) memcpy(&n, bytes, sizeof(n));
+    return n;
+}
+
+// relocates an object id, checking it is the type the field needs
+static Obj *readRef(Loader *l, Reader *r, ObjType type, bool optional) {
+    uint32_t id = readU32(r);
+    if (!r->ok || (optional && id == NO_OBJ)) return NULL;
+
+    if (id >= l->objCnt || l->objs[id] == NULL || l->objs[id]->type != type) {
+        r->ok = false;
+        return NULL;
+    }
+    return l->objs[id];
+}
+
+static Value readValue(Loader *l, Reader *r) {
+    switch (readU32(r)) {
+    case IMAGE_NIL:    return NIL_VAL;
+    case IMAGE_BOOL:   return BOOL_VAL(readU32(r) != 0);
+    case IMAGE_NUMBER: return NUMBER_VAL(readDouble(r));
+    case IMAGE_EMPTY:  return EMPTY_VAL;
+    case IMAGE_OBJ:    {
+        uint32_t id = readU32(r);
+        if (id < l->objCnt && l->objs[id] != NULL) return OBJ_VAL(l->objs[id]);
+    } break;
+    }
+
+    r->ok = false;
+    return NIL_VAL;
+}
+
+static void readValues(Loader *l, Reader *r, ValueArray *array) {
+    uint32_t cnt = readU32(r);
+    for (uint32_t i = 0; i < cnt && r->ok; i++) {
+        writeValueArray(l->vm, array, readValue(l, r));
+    }
+}
+
+static void readTable(Loader *l, Reader *r, Table *table) {
+    uint32_t cnt = readU32(r);
+    for (uint32_t i = 0; i < cnt && r->ok; i++) {
+        Value key = readValue(l, r);
+        Value value = readValue(l, r);
+        if (r->ok) tableSet(l->vm, table, key, value);
+    }
+}
+
+static void readDict(Loader *l, Reader *r, Dict *dict) {
+    uint32_t cnt = readU32(r);
+    for (uint32_t i = 0; i < cnt && r->ok; i++) {
+        Value key = readValue(l, r);
+        Value value = readValue(l, r);
+        if (r->ok) dictSet(l->vm, dict, key, value);
+    }
+}
+
+// strings and natives are complete straight away, everything else only gets
+// its pointers once every object exists. closures are made after the
+// functions they need
+static Obj *newShell(VM *vm, ObjType type, Reader *r) {
+    switch (type) {
+    case OBJ_STRING: {
+        uint32_t len = readU32(r);
+        const uint8_t *chars = readBytes(r, len);
+        if (chars == NULL) return NULL;
+        return (Obj *)copyString(vm, (const char *)chars, (int)len);
+    }
+    case OBJ_NATIVE: {
+        uint32_t len = readU32(r);
+        const uint8_t *name = readBytes(r, len);
+        if (name == NULL) return NULL;
+        NativeFn fn = findNative((const char *)name, (int)len);
+        if (fn == NULL) return NULL;
+        return (Obj *)newNative(vm, fn);
+    }
+    case OBJ_FUNCTION: {
+        ObjFn *fn = newFunction(vm);
+        fn->arity = (int)readU32(r);
+        fn->upvalueCnt = (int)readU32(r);
+        return (Obj *)fn;
+    }
+    case OBJ_UPVALUE: {
+        ObjUpvalue *upvalue = newUpvalue(vm, NULL);
+        upvalue->location = &upvalue->closed;
+        return (Obj *)upvalue;
+    }
+    case OBJ_CLASS:        return (Obj *)newClass(vm, NULL);
+    case OBJ_INSTANCE:     return (Obj *)newInstance(vm, NULL);
+    case OBJ_BOUND_METHOD: return (Obj *)newBoundMethod(vm, NIL_VAL, NULL);
+    case OBJ_ERROR:        return (Obj *)newError(vm, false, "%s", "");
+    case OBJ_ARRAY:        return (Obj *)newArray(vm);
+    case OBJ_MAP:          return (Obj *)newMap(vm);
+    case OBJ_RANGE:        return (Obj *)newRange(vm, 0, 0, 0);
+    case OBJ_WEAK_MAP:     return (Obj *)newWeakMap(vm);
+    case OBJ_WEAK_REF:     return (Obj *)newWeakRef(vm, NIL_VAL);
+    case OBJ_CLOSURE:
+    default:               return NULL;
+    }
+}
+
+static void readFunction(Loader *l, Reader *r, ObjFn *fn) {
+    VM *vm = l->vm;
+    readU32(r); // arity
+    readU32(r); // upvalueCnt
+    fn->name = (ObjString *)readRef(l, r, OBJ_STRING, true);
+
+    Chunk *chunk = &fn->chunk;
+    uint32_t codeCnt = readU32(r);
+    const uint8_t *code = readBytes(r, codeCnt);
+    if (code == NULL) return;
+    chunk->code = ALLOCATE(uint8_t, codeCnt);
+    memcpy(chunk->code, code, codeCnt);
+    chunk->cnt = chunk->cap = (int)codeCnt;
+
+    uint32_t lineCnt = readU32(r);
+    if (!r->ok || (size_t)(r->end - r->at) / (2 * sizeof(uint32_t)) < lineCnt) {
+        r->ok = false;
+        return;
+    }
+    chunk->lines = ALLOCATE(LineInfo, lineCnt);
+    chunk->lineCnt = chunk->lineCap = (int)lineCnt;
+    for (uint32_t i = 0; i < lineCnt; i++) {
+        chunk->lines[i].offset = (int)readU32(r);
+        chunk->lines[i].line = (int)readU32(r);
+    }
+
+    readValues(l, r, &chunk->constants);
+}
+
+// fills in everything but tables, whose keys may hash the fields of objects
+// that haven't been filled in yet
+static void fillObject(Loader *l, Reader *r, Obj *obj) {
+    switch (obj->type) {
+    case OBJ_FUNCTION: readFunction(l, r, (ObjFn *)obj); break;
+    case OBJ_CLOSURE:  {
+        ObjClosure *closure = (ObjClosure *)obj;
+        readU32(r); // fn
+        for (int i = 0; i < closure->upvalueCnt; i++) {
+            closure->upvalues[i] = readValue(l, r);
+        }
+    } break;
+    case OBJ_UPVALUE: {
+        ((ObjUpvalue *)obj)->closed = readValue(l, r);
+    } break;
+    case OBJ_CLASS: {
+        ((ObjClass *)obj)->name = (ObjString *)readRef(l, r, OBJ_STRING, false);
+    } break;
+    case OBJ_INSTANCE: {
+        ((ObjInstance *)obj)->klass =
+            (ObjClass *)readRef(l, r, OBJ_CLASS, false);
+    } break;
+    case OBJ_BOUND_METHOD: {
+        ObjBoundMethod *bound = (ObjBoundMethod *)obj;
+        bound->method = (ObjClosure *)readRef(l, r, OBJ_CLOSURE, false);
+        bound->receiver = readValue(l, r);
+    } break;
+    case OBJ_ERROR: {
+        ObjError *error = (ObjError *)obj;
+        error->msg = (ObjString *)readRef(l, r, OBJ_STRING, false);
+        error->recoverable = readU32(r) != 0;
+    } break;
+    case OBJ_ARRAY: {
+        ObjArray *arr = (ObjArray *)obj;
+        readValues(l, r, &arr->items);
+        for (int i = 0; i < arr->items.cnt; i++) {
+            noteRef(arr, arr->items.values[i]);
+        }
+    } break;
+    case OBJ_RANGE: {
+        ObjRange *range = (ObjRange *)obj;
+        range->start = readDouble(r);
+        range->stop = readDouble(r);
+        range->step = readDouble(r);
+    } break;
+    case OBJ_MAP:
+    case OBJ_WEAK_MAP:
+    case OBJ_WEAK_REF:
+    case OBJ_NATIVE:
+    case OBJ_STRING: break;
+    }
+}
+
+static void fillTables(Loader *l, Reader *r, Obj *obj) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wswitch-enum"
+    switch (obj->type) {
+    case OBJ_CLASS: {
+        readU32(r); // name
+        readTable(l, r, &((ObjClass *)obj)->methods);
+    } break;
+    case OBJ_INSTANCE: {
+        readU32(r); // klass
+        readTable(l, r, &((ObjInstance *)obj)->fields);
+    } break;
+    case OBJ_MAP: readDict(l, r, &((ObjMap *)obj)->items); break;
+    default:      break;
+    }
+#pragma GCC diagnostic pop
+}
+
+static bool readObjects(Loader *l, Reader *r, Reader *records) {
+    VM *vm = l->vm;
+    uint8_t *types = (uint8_t *)malloc(l->objCnt + 1);
+    if (types == NULL) exit(1);
+
+    for (uint32_t i = 0; i < l->objCnt && r->ok; i++) {
+        uint32_t type = readU32(r);
+        uint32_t size = readU32(r);
+        const uint8_t *fields = readBytes(r, size);
+        if (fields == NULL || type >= OBJ_TYPE_CNT) {
+            r->ok = false;
+            break;
+        }
+
+        types[i] = (uint8_t)type;
+        records[i] = (Reader){fields, fields + size, true};
+        if (type == OBJ_CLOSURE) continue;
+
+        Reader shell = records[i];
+        l->objs[i] = newShell(vm, (ObjType)type, &shell);
+        if (l->objs[i] == NULL) r->ok = false;
+    }
+
+    for (uint32_t i = 0; i < l->objCnt && r->ok; i++) {
+        if (types[i] != OBJ_CLOSURE) continue;
+        Reader shell = records[i];
+        ObjFn *fn = (ObjFn *)readRef(l, &shell, OBJ_FUNCTION, false);
+        if (fn == NULL) {
+            r->ok = false;
+        } else {
+            l->objs[i] = (Obj *)newClosure(vm, fn);
+        }
+    }
+    free(types);
+
+    for (uint32_t i = 0; i < l->objCnt && r->ok; i++) {
+        Reader fields = records[i];
+        fillObject(l, &fields, l->objs[i]);
+        if (!fields.ok) r->ok = false;
+    }
+
+    for (uint32_t i = 0; i < l->objCnt && r->ok; i++) {
+        Reader fields = records[i];
+        fillTables(l, &fields, l->objs[i]);
+        if (!fields.ok) r->ok = false;
+    }
+    return r->ok;
+}
+
+// weak refs can only point at objects, and weak maps only have object keys
+static bool readWeak(Loader *l, Reader *r) {
+    for (uint32_t i = 0; i < l->objCnt && r->ok; i++) {
+        Obj *obj = l->objs[i];
+        if (obj->type == OBJ_WEAK_REF) {
+            Value target = readValue(l, r);
+            if (!IS_OBJ(target) && !IS_NIL(target)) r->ok = false;
+            ((ObjWeakRef *)obj)->target = target;
+        } else if (obj->type == OBJ_WEAK_MAP) {
+            Table *items = &((ObjWeakMap *)obj)->items;
+            uint32_t cnt = readU32(r);
+            for (uint32_t j = 0; j < cnt && r->ok; j++) {
+                Value key = readValue(l, r);
+                Value value = readValue(l, r);
+                if (!IS_OBJ(key)) r->ok = false;
+                if (r->ok) tableSet(l->vm, items, key, value);
+            }
+        }
+    }
+    return r->ok;
+}
+
+static bool readGlobals(Loader *l, Reader *r) {
+    VM *vm = l->vm;
+    Table names;
+    ValueArray values;
+    initTable(&names);
+    initValueArray(&values);
+
+    readTable(l, r, &names);
+    readValues(l, r, &values);
+
+    for (int i = 0; i < names.cap && r->ok; i++) {
+        Entry *entry = &names.entries[i];
+        if (IS_EMPTY(entry->key)) continue;
+        if (!IS_STRING(entry->key) || !IS_NUMBER(entry->value) ||
+            AS_NUMBER(entry->value) < 0 ||
+            AS_NUMBER(entry->value) >= values.cnt) {
+            r->ok = false;
+        }
+    }
+
+    if (!r->ok || r->at != r->end) {
+        freeTable(vm, &names);
+        freeValueArray(vm, &values);
+        return false;
+    }
+
+    freeTable(vm, &vm->globalNames);
+    freeValueArray(vm, &vm->globalValues);
+    vm->globalNames = names;
+    vm->globalValues = values;
+    return true;
+}
+
+static char *readImageFile(const char *path, size_t *size) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) return NULL;
+
+    fseek(f, 0L, SEEK_END);
+    long fsize = ftell(f);
+    rewind(f);
+
+    char *buffer = fsize < 0 ? NULL : (char *)malloc(fsize + 1);
+    if (buffer == NULL || fread(buffer, 1, fsize, f) != (size_t)fsize) {
+        free(buffer);
+        fclose(f);
+        return NULL;
+    }
+
+    fclose(f);
+    *size = (size_t)fsize;
+    return buffer;
+}
+
+bool loadImage(VM *vm, const char *path) {
+    size_t size = 0;
+    char *bytes = readImageFile(path, &size);
+    if (bytes == NULL) return false;
+
+    Reader r = {(const uint8_t *)bytes, (const uint8_t *)bytes + size, true};
+    ImageHeader header = {0};
+    const uint8_t *head = readBytes(&r, sizeof(header));
+    if (head != NULL) memcpy(&header, head, sizeof(header));
+
+    // every record is at least its type and size
+    if (head == NULL ||
+        memcmp(header.magic, IMAGE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != VERSION_STAMP ||
+        header.objCnt > (size - sizeof(header)) / 8) {
+        free(bytes);
+        return false;
+    }
+
+    Loader l = {vm, NULL, header.objCnt};
+    l.objs = (Obj **)calloc(header.objCnt + 1, sizeof(Obj *));
+    Reader *records = (Reader *)calloc(header.objCnt + 1, sizeof(Reader));
+    if (l.objs == NULL || records == NULL) exit(1);
+
+    // nothing is reachable until the globals are swapped in at the end
+    vm->gcPaused = true;
+    bool ok = readObjects(&l, &r, records) && readWeak(&l, &r) &&
+              readGlobals(&l, &r);
+    vm->gcPaused = false;
+
+    free(records);
+    free(l.objs);
+    free(bytes);
+    return ok;
+}
@@ -0,0 +1,17 @@
+#ifndef INCLUDE_CLOX_IMAGE_H_
+#define INCLUDE_CLOX_IMAGE_H_
+
+#include "common.h"
+#include "vm.h"
+
+// bump whenever the bytecode or the layout of heap images changes
+#define IMAGE_VERSION 2
+
+// writes every object reachable from the globals to `path`, so a later
+// process can start from this heap instead of running the same prelude
+bool saveImage(VM *vm, const char *path);
+
+// replaces the globals of a freshly initialised VM with the ones in `path`
+bool loadImage(VM *vm, const char *path);
+
+#endif // INCLUDE_CLOX_IMAGE_H_
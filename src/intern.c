@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "intern.h"
+#include "memory.h"
+#include "object.h"
+
+#define INTERN_MAX_LOAD 0.75
+
+// the set is resized in the middle of collections, so it is not allocated
+// through reallocate, which could start another one
+
+void initInternSet(InternSet *set) { *set = (InternSet){0}; }
+
+void freeInternSet(InternSet *set) {
+    free(set->hashes);
+    free(set->strings);
+    initInternSet(set);
+}
+
+// what a slot holds of the hash. 0 is an empty slot
+static inline uint32_t tagOf(uint32_t hash) { return hash | 1; }
+
+static void insert(uint32_t *hashes, ObjString **strings, int cap,
+                   ObjString *string) {
+    uint32_t idx = string->hash & (cap - 1);
+    while (hashes[idx] != 0) idx = (idx + 1) & (cap - 1);
+    hashes[idx] = tagOf(string->hash);
+    strings[idx] = string;
+}
+
+// moves the strings still in the set to new arrays of `cap` slots
+static void rebuild(InternSet *set, int cap) {
+    uint32_t *hashes = (uint32_t *)calloc(cap, sizeof(uint32_t));
+    ObjString **strings = (ObjString **)malloc(sizeof(ObjString *) * cap);
+    if (hashes == NULL || strings == NULL) exit(1);
+
+    for (int i = 0; i < set->cap; i++) {
+        if (set->hashes[i] != 0) insert(hashes, strings, cap, set->strings[i]);
+    }
+    free(set->hashes);
+    free(set->strings);
+    set->hashes = hashes;
+    set->strings = strings;
+    set->cap = cap;
+}
+
+ObjString *internFind(InternSet *set, const char *chars, int len,
+                      uint32_t hash) {
+    if (set->cnt == 0) return NULL;
+
+    uint32_t tag = tagOf(hash);
+    uint32_t idx = hash & (set->cap - 1);
+    for (;;) {
+        uint32_t slot = set->hashes[idx];
+        if (slot == 0) return NULL;
+        if (slot == tag) {
+            ObjString *string = set->strings[idx];
+            if (string->length == len &&
+                memcmp(string->chars, chars, len) == 0) {
+                return string;
+            }
+        }
+        idx = (idx + 1) & (set->cap - 1);
+    }
+}
+
+void internAdd(InternSet *set, ObjString *string) {
+    if (set->cnt + 1 > set->cap * INTERN_MAX_LOAD) {
+        rebuild(set, GROW_CAP(set->cap));
+    }
+    insert(set->hashes, set->strings, set->cap, string);
+    set->cnt++;
+}
+
+void internRemove(InternSet *set, ObjString *string) {
+    uint32_t mask = (uint32_t)set->cap - 1;
+    uint32_t hole = string->hash & mask;
+    while (set->strings[hole] != string || set->hashes[hole] == 0) {
+        hole = (hole + 1) & mask;
+    }
+
+    // a string after the hole moves into it unless its home slot lies
+    // between the hole and where it is, as probes would no longer reach it
+    for (uint32_t idx = (hole + 1) & mask; set->hashes[idx] != 0;
+         idx = (idx + 1) & mask) {
+        uint32_t home = set->strings[idx]->hash & mask;
+        if (((idx - home) & mask) >= ((idx - hole) & mask)) {
+            set->hashes[hole] = set->hashes[idx];
+            set->strings[hole] = set->strings[idx];
+            hole = idx;
+        }
+    }
+    set->hashes[hole] = 0;
+    set->cnt--;
+}
+
+void internRemoveWhite(InternSet *set) {
+    int live = 0;
+    for (int i = 0; i < set->cap; i++) {
+        if (set->hashes[i] == 0) continue;
+        if (isMarked((Obj *)set->strings[i])) {
+            live++;
+        } else {
+            set->hashes[i] = 0;
+        }
+    }
+    if (live == set->cnt) return;
+
+    // the holes broke up the probe sequences, and the set can shrink
+    int cap = 8;
+    while (live > cap * INTERN_MAX_LOAD) cap *= 2;
+    rebuild(set, cap);
+    set->cnt = live;
+}
@@ -0,0 +1,29 @@
+#ifndef INCLUDE_CLOX_INTERN_H_
+#define INCLUDE_CLOX_INTERN_H_
+
+#include "common.h"
+#include "object.h"
+
+// the set every string is interned in. the hashes are kept in an array of
+// their own, so a probe only looks at a string once its hash matches. there
+// are no tombstones: a string removed on its own has the strings after it
+// shifted back, and a major collection rebuilds the set
+typedef struct {
+    int cnt;
+    int cap;
+    uint32_t *hashes;
+    ObjString **strings;
+} InternSet;
+
+void initInternSet(InternSet *set);
+void freeInternSet(InternSet *set);
+ObjString *internFind(InternSet *set, const char *chars, int len,
+                      uint32_t hash);
+// `string` must not be in the set yet
+void internAdd(InternSet *set, ObjString *string);
+// `string` must be in the set
+void internRemove(InternSet *set, ObjString *string);
+// drops the strings a major collection is about to free
+void internRemoveWhite(InternSet *set);
+
+#endif // INCLUDE_CLOX_INTERN_H_
@@ -1,6 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "aot.h"
+#include "cache.h"
+#include "compiler.h"
+#include "image.h"
 #include "thirdparty_linenoise.h"
 #include "vm.h"
 
@@ -53,31 +58,187 @@ static char *readFile(const char *path) {
     return buffer;
 }
 
-static void runFile(VM *vm, const char *path) {
+// the cache of `file.lox` lives next to it in `file.loxc`
+static char *cachePath(const char *path) {
+    size_t len = strlen(path);
+    char *cache = (char *)malloc(len + 2);
+    if (cache == NULL) {
+        fprintf(stderr, "buy more RAM lol\n");
+        exit(74);
+    }
+    memcpy(cache, path, len);
+    cache[len] = 'c';
+    cache[len + 1] = '\0';
+    return cache;
+}
+
+// writes the .loxc of `path`, or C source to `aot` if it isn't NULL
+static void compileFile(VM *vm, const char *path, const char *aot) {
+    char *src = readFile(path);
+    char *cache = cachePath(path);
+
+    ObjFn *script = compile(vm, src);
+    if (script == NULL) exit(65);
+
+    pushRoot(vm, OBJ_VAL(script));
+    const char *out = aot != NULL ? aot : cache;
+    bool ok = aot != NULL ? writeAot(vm, script, aot)
+                          : writeCache(vm, script, cache, hashSource(src));
+    if (!ok) {
+        fprintf(stderr, "Could not write '%s'\n", out);
+        exit(74);
+    }
+    popRoot(vm);
+
+    free(cache);
+    free(src);
+}
+
+// returns the exit status of the script
+static int runFile(VM *vm, const char *path) {
     char *src = readFile(path);
-    InterpretResult result = interpret(vm, src);
+    char *cache = cachePath(path);
+
+    // a stale or broken cache is ignored and the source compiled instead
+    ObjFn *script = loadCache(vm, cache, hashSource(src));
+    InterpretResult result = script != NULL ? interpretFunction(vm, script)
+                                            : interpret(vm, src);
+    free(cache);
     free(src);
 
     switch (result) {
-    case INTERPRET_COMPILE_ERR: exit(65);
-    case INTERPRET_RUNTIME_ERR: exit(70);
-    case INTERPRET_OK:          return;
+    case INTERPRET_COMPILE_ERR: return 65;
+    case INTERPRET_RUNTIME_ERR: return 70;
+    case INTERPRET_OK:          return EXIT_SUCCESS;
     default:
         fprintf(stderr, "[unreachable] can't have any other VM exit code\n");
         exit(64);
     }
 }
 
+static void usage(void) {
+    fprintf(stderr, "Usage: clox [--lazy] [--compile] [--aot out.c] "
+                    "[--image in.img] [--snapshot out.img] [--gc-step n] "
+                    "[--gc-concurrent] [--gc-workers n] [--gc-huge-pages] "
+                    "[--gc-max-heap mib] [--gc-cpu percent] "
+                    "[--gc-min-interval ms] [--gc-stats] [--gc-arena] "
+                    "[path]\n");
+    exit(64);
+}
+
+// the limits major collections are paced within. each also has a CLOX_GC_*
+// variable in the environment, which the command line overrides
+static void setMaxHeap(VM *vm, const char *mib) {
+    int n = atoi(mib);
+    if (n < 0) usage();
+    vm->pacer.maxHeap = (size_t)n * 1024 * 1024;
+    if (n > 0 && vm->nextMajorGC > vm->pacer.maxHeap) {
+        vm->nextMajorGC = vm->pacer.maxHeap;
+    }
+}
+
+static void setCpuTarget(VM *vm, const char *percent) {
+    int n = atoi(percent);
+    if (n <= 0 || n > 100) usage();
+    vm->pacer.cpuTarget = n / 100.0;
+}
+
+static void setMinInterval(VM *vm, const char *ms) {
+    int n = atoi(ms);
+    if (n < 0) usage();
+    vm->pacer.minInterval = n / 1000.0;
+}
+
+static void gcFromEnv(VM *vm) {
+    const char *value = getenv("CLOX_GC_MAX_HEAP");
+    if (value != NULL) setMaxHeap(vm, value);
+    value = getenv("CLOX_GC_CPU");
+    if (value != NULL) setCpuTarget(vm, value);
+    value = getenv("CLOX_GC_MIN_INTERVAL");
+    if (value != NULL) setMinInterval(vm, value);
+    // any value but 0 marks on a thread of its own even on one core
+    value = getenv("CLOX_GC_CONCURRENT");
+    if (value != NULL) vm->gcConcurrent = atoi(value) != 0;
+}
+
 int main(int argc, char *argv[]) {
     VM vm = {0};
     initVM(&vm);
+    gcFromEnv(&vm);
 
-    switch (argc) {
-    case 1:  repl(&vm); break;
-    case 2:  runFile(&vm, argv[1]); break;
-    default: fprintf(stderr, "Usage: clox [path]\n"); exit(64);
+    const char *path = NULL;
+    const char *image = NULL;
+    const char *snapshot = NULL;
+    const char *aot = NULL;
+    bool compileOnly = false;
+    bool gcStats = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--lazy") == 0) {
+            vm.lazyCompile = true;
+        } else if (strcmp(argv[i], "--compile") == 0) {
+            compileOnly = true;
+        } else if (strcmp(argv[i], "--aot") == 0 && i + 1 < argc) {
+            aot = argv[++i];
+            compileOnly = true;
+        } else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+            image = argv[++i];
+        } else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+            snapshot = argv[++i];
+        } else if (strcmp(argv[i], "--gc-step") == 0 && i + 1 < argc) {
+            vm.gcStepWork = atoi(argv[++i]);
+            vm.gcConcurrent = false;
+            if (vm.gcStepWork <= 0) usage();
+        } else if (strcmp(argv[i], "--gc-concurrent") == 0) {
+            vm.gcConcurrent = true;
+        } else if (strcmp(argv[i], "--gc-workers") == 0 && i + 1 < argc) {
+            vm.gcWorkers = atoi(argv[++i]);
+            if (vm.gcWorkers <= 0 || vm.gcWorkers > GC_WORKERS_MAX) usage();
+        } else if (strcmp(argv[i], "--gc-huge-pages") == 0) {
+            useHugePages(&vm);
+        } else if (strcmp(argv[i], "--gc-max-heap") == 0 && i + 1 < argc) {
+            setMaxHeap(&vm, argv[++i]);
+        } else if (strcmp(argv[i], "--gc-cpu") == 0 && i + 1 < argc) {
+            setCpuTarget(&vm, argv[++i]);
+        } else if (strcmp(argv[i], "--gc-min-interval") == 0 && i + 1 < argc) {
+            setMinInterval(&vm, argv[++i]);
+        } else if (strcmp(argv[i], "--gc-stats") == 0) {
+            gcStats = true;
+        } else if (strcmp(argv[i], "--gc-arena") == 0) {
+            vm.gcArena = true;
+        } else if (argv[i][0] == '-' || path != NULL) {
+            usage();
+        } else {
+            path = argv[i];
+        }
+    }
+
+    if (image != NULL && !loadImage(&vm, image)) {
+        fprintf(stderr, "Could not load image '%s'\n", image);
+        exit(74);
+    }
+
+    int status = EXIT_SUCCESS;
+    if (compileOnly) {
+        if (path == NULL) usage();
+        compileFile(&vm, path, aot);
+    } else if (path == NULL) {
+        repl(&vm);
+    } else {
+        status = runFile(&vm, path);
+    }
+
+    if (gcStats) printGcStats(&vm);
+    if (status != EXIT_SUCCESS) exit(status);
+
+    // the heap as the script left it, ready for --image
+    if (snapshot != NULL && !saveImage(&vm, snapshot)) {
+        fprintf(stderr, "Could not write image '%s'\n", snapshot);
+        exit(74);
     }
 
+    // the os takes the heap back in one go, freeing it object by object is
+    // only worth it when the vm outlives the objects
+    if (vm.gcArena) return EXIT_SUCCESS;
     freeVM(&vm);
     return EXIT_SUCCESS;
 }
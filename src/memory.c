@@ -1,4 +1,13 @@
+// for mremap
+#define _GNU_SOURCE
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
 
 #include "compiler.h"
 #include "memory.h"
@@ -6,20 +15,488 @@
 #include "value.h"
 #include "vm.h"
 
-#ifdef DEBUG_LOG_GC
-#include <stdio.h>
+// how far the heap grows past what survived a major collection before the
+// next one, until the pacer has measured anything, and at the most
+#define GC_HEAP_GROW_FACTOR 2
+#define GC_MAX_GROWTH       8
+// how much a new measurement moves the pacer's averages
+#define GC_PACE_WEIGHT 0.5
+// the allocations between the major collections stress mode starts
+#define GC_STRESS_MAJOR_EVERY 64
+
+// a work stealing deque of gray objects, after Chase and Lev. only the
+// owning worker pushes and takes at the bottom, the others steal from the top
+typedef struct DequeBuffer {
+    int64_t size;
+    // buffers outgrown while a thief may still be reading them
+    struct DequeBuffer *prev;
+    Obj *items[];
+} DequeBuffer;
+
+typedef struct {
+    int64_t top;
+    int64_t bottom;
+    DequeBuffer *buffer;
+} GrayDeque;
+
+typedef struct MarkWorkers MarkWorkers;
+
+typedef struct {
+    VM *vm;
+    MarkWorkers *all;
+    GrayDeque deque;
+    unsigned int seed;
+} MarkWorker;
+
+struct MarkWorkers {
+    MarkWorker workers[GC_WORKERS_MAX];
+    // workers that are running and ones that have run out of work
+    int cnt;
+    int idle;
+};
+
+// set while a thread is one of the workers of a parallel mark
+static _Thread_local MarkWorker *currentWorker = NULL;
+
+// objects live in pages of slots of one size. a page is aligned to its
+// size, so the page of an object is found by masking its address
+#define SLAB_PAGE_SHIFT    16
+#define SLAB_PAGE_SIZE     ((size_t)1 << SLAB_PAGE_SHIFT)
+#define SLAB_GRANULE_SHIFT 3
+#define SLAB_WORDS         ((SLAB_PAGE_SIZE >> SLAB_GRANULE_SHIFT) / 64)
+// pages are cut from chunks the size of a huge page
+#define SLAB_CHUNK_SIZE    ((size_t)2 * 1024 * 1024)
+// sizes go up 8 bytes at a time until this, then four steps per doubling
+#define SLAB_SMALL_CLASSES 32
+#define SLAB_SMALL_MAX     ((size_t)SLAB_SMALL_CLASSES << SLAB_GRANULE_SHIFT)
+#define SLAB_MAX_SIZE      ((size_t)16 * 1024)
+// the size class of pages that hold a single object too big for the rest
+#define SLAB_LARGE         -1
+// the size class of the pages objects of any size are bumped into in arena
+// mode
+#define SLAB_ARENA         -2
+
+struct SlabPage {
+    // the next page in the list of pages the vm keeps it in, large ones are
+    // linked both ways so they can be unmapped as soon as they are freed
+    SlabPage *next;
+    SlabPage *prev;
+    // the next page of the same size class with free slots
+    SlabPage *nextFree;
+    // freed slots, linked through their first word
+    Obj *freeList;
+    // the slots from here on were never used
+    char *bump;
+    size_t slotSize;
+    int sizeClass;
+    int liveCnt;
+    bool inFreeList;
+    bool isUnswept;
+    // a bit per 8 bytes, for the slot starting there
+    uint64_t marks[SLAB_WORDS];
+    uint64_t live[SLAB_WORDS];
+};
+
+#define SLAB_FIRST_SLOT ((sizeof(SlabPage) + 7) & ~(size_t)7)
+
+// free slots are poisoned, so asan still catches the mutator using objects
+// the collector freed
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/asan_interface.h>
+#define POISON(ptr, size)   ASAN_POISON_MEMORY_REGION(ptr, size)
+#define UNPOISON(ptr, size) ASAN_UNPOISON_MEMORY_REGION(ptr, size)
+#else
+#define POISON(ptr, size)   ((void)(ptr), (void)(size))
+#define UNPOISON(ptr, size) ((void)(ptr), (void)(size))
+#endif // ifdef __SANITIZE_ADDRESS__
+
+static size_t slotSizeOf(int sizeClass) {
+    if (sizeClass < SLAB_SMALL_CLASSES) {
+        return (size_t)(sizeClass + 1) << SLAB_GRANULE_SHIFT;
+    }
+    int shift = 6 + (sizeClass - SLAB_SMALL_CLASSES) / 4;
+    return (size_t)(5 + (sizeClass - SLAB_SMALL_CLASSES) % 4) << shift;
+}
+
+static int sizeClassOf(size_t size) {
+    if (size <= SLAB_SMALL_MAX) return (int)((size - 1) >> SLAB_GRANULE_SHIFT);
+    // the top three bits of the size pick the step within its doubling
+    int log = 63 - __builtin_clzll(size - 1);
+    return SLAB_SMALL_CLASSES + (log - 8) * 4 + (int)((size - 1) >> (log - 2)) -
+           4;
+}
+
+static inline SlabPage *pageOf(Obj *object) {
+    return (SlabPage *)((uintptr_t)object & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+}
+
+static inline Obj *objectAt(SlabPage *page, size_t granule) {
+    return (Obj *)((char *)page + (granule << SLAB_GRANULE_SHIFT));
+}
+
+static inline size_t granuleOf(Obj *object) {
+    return ((uintptr_t)object & (SLAB_PAGE_SIZE - 1)) >> SLAB_GRANULE_SHIFT;
+}
+
+bool isMarked(Obj *object) {
+    size_t granule = granuleOf(object);
+    uint64_t word =
+        __atomic_load_n(&pageOf(object)->marks[granule / 64], __ATOMIC_RELAXED);
+    return word & ((uint64_t)1 << (granule % 64));
+}
+
+// returns whether it was marked already
+static bool setMarked(Obj *object) {
+    size_t granule = granuleOf(object);
+    uint64_t *word = &pageOf(object)->marks[granule / 64];
+    uint64_t bit = (uint64_t)1 << (granule % 64);
+
+    if (currentWorker != NULL) {
+        // other workers can be marking objects that share the word
+        if (__atomic_load_n(word, __ATOMIC_RELAXED) & bit) return true;
+        return __atomic_fetch_or(word, bit, __ATOMIC_ACQ_REL) & bit;
+    }
+
+    // no other thread is marking, but others can be reading the bits
+    uint64_t bits = __atomic_load_n(word, __ATOMIC_RELAXED);
+    __atomic_store_n(word, bits | bit, __ATOMIC_RELAXED);
+    return bits & bit;
+}
+
+static void clearMark(Obj *object) {
+    size_t granule = granuleOf(object);
+    pageOf(object)->marks[granule / 64] &= ~((uint64_t)1 << (granule % 64));
+}
+
+static void hugePages(char *chunk) {
+#ifdef MADV_HUGEPAGE
+    madvise(chunk, SLAB_CHUNK_SIZE, MADV_HUGEPAGE);
+#else
+    (void)chunk;
+#endif // ifdef MADV_HUGEPAGE
+}
+
+void useHugePages(VM *vm) {
+    vm->gcHugePages = true;
+    for (int i = 0; i < vm->chunkCnt; i++) {
+        hugePages(vm->chunks[i]);
+    }
+}
+
+// maps `align` more than asked for, then gives back what is left over on
+// either side of the aligned memory in the middle
+static char *mapAligned(size_t size, size_t align) {
+    size_t mapped = size + align;
+    char *base = (char *)mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) exit(1);
+
+    char *start =
+        (char *)(((uintptr_t)base + align - 1) & ~(uintptr_t)(align - 1));
+    if (start > base) munmap(base, (size_t)(start - base));
+    char *end = start + size;
+    if (end < base + mapped) munmap(end, (size_t)(base + mapped - end));
+    return start;
+}
+
+static void reserveChunk(VM *vm) {
+    char *chunk = mapAligned(SLAB_CHUNK_SIZE, SLAB_CHUNK_SIZE);
+    char *end = chunk + SLAB_CHUNK_SIZE;
+    if (vm->gcHugePages) hugePages(chunk);
+
+    if (vm->chunkCap < vm->chunkCnt + 1) {
+        vm->chunkCap = GROW_CAP(vm->chunkCap);
+        vm->chunks =
+            (char **)realloc(vm->chunks, sizeof(char *) * vm->chunkCap);
+
+        if (vm->chunks == NULL) exit(1);
+    }
+    vm->chunks[vm->chunkCnt++] = chunk;
+    vm->chunkNext = chunk;
+    vm->chunkEnd = end;
+}
+
+static bool hasFreeSlots(SlabPage *page) {
+    return page->freeList != NULL ||
+           page->bump + page->slotSize <= (char *)page + SLAB_PAGE_SIZE;
+}
+
+static void pushFreePage(VM *vm, SlabPage *page) {
+    page->inFreeList = true;
+    page->nextFree = vm->slabs[page->sizeClass];
+    vm->slabs[page->sizeClass] = page;
+}
+
+// an emptied page if there is one, else a fresh one from a chunk. the
+// bitmaps of both are all clear
+static SlabPage *takePage(VM *vm) {
+    SlabPage *page = vm->emptyPages;
+    if (page != NULL) {
+        vm->emptyPages = page->next;
+        return page;
+    }
+
+    if (vm->chunkNext == vm->chunkEnd) reserveChunk(vm);
+    page = (SlabPage *)vm->chunkNext;
+    vm->chunkNext += SLAB_PAGE_SIZE;
+    POISON((char *)page + SLAB_FIRST_SLOT, SLAB_PAGE_SIZE - SLAB_FIRST_SLOT);
+    return page;
+}
+
+static SlabPage *newPage(VM *vm, int sizeClass) {
+    SlabPage *page = takePage(vm);
+    page->freeList = NULL;
+    page->bump = (char *)page + SLAB_FIRST_SLOT;
+    page->slotSize = slotSizeOf(sizeClass);
+    page->sizeClass = sizeClass;
+    page->liveCnt = 0;
+    page->isUnswept = false;
+
+    page->next = vm->pages;
+    vm->pages = page;
+    pushFreePage(vm, page);
+    return page;
+}
+
+static Obj *takeSlot(VM *vm, int sizeClass) {
+    SlabPage *page = vm->slabs[sizeClass];
+    if (page == NULL) page = newPage(vm, sizeClass);
+
+    Obj *object;
+    if (page->freeList != NULL) {
+        object = page->freeList;
+        UNPOISON(object, page->slotSize);
+        page->freeList = *(Obj **)object;
+    } else {
+        object = (Obj *)page->bump;
+        UNPOISON(object, page->slotSize);
+        page->bump += page->slotSize;
+    }
+
+    size_t granule = granuleOf(object);
+    page->live[granule / 64] |= (uint64_t)1 << (granule % 64);
+    page->liveCnt++;
+
+    if (!hasFreeSlots(page)) {
+        vm->slabs[sizeClass] = page->nextFree;
+        page->inFreeList = false;
+    }
+    return object;
+}
+
+static void pushLarge(VM *vm, SlabPage *page) {
+    page->prev = NULL;
+    page->next = vm->largePages;
+    if (vm->largePages != NULL) vm->largePages->prev = page;
+    vm->largePages = page;
+}
+
+// objects too big for any slab get a mapping of their own. it is laid out
+// like a page with a single slot, so the collector can treat it as one
+static Obj *takeLarge(VM *vm, size_t span) {
+    SlabPage *page = (SlabPage *)mapAligned(span, SLAB_PAGE_SIZE);
+    page->slotSize = span;
+    page->sizeClass = SLAB_LARGE;
+    page->bump = (char *)page + span;
+    page->liveCnt = 1;
+    pushLarge(vm, page);
+
+    Obj *object = (Obj *)((char *)page + SLAB_FIRST_SLOT);
+    size_t granule = granuleOf(object);
+    page->live[granule / 64] |= (uint64_t)1 << (granule % 64);
+    return object;
+}
+
+static void unmapLarge(VM *vm, SlabPage *page) {
+    if (page->prev != NULL) {
+        page->prev->next = page->next;
+    } else {
+        vm->largePages = page->next;
+    }
+    if (page->next != NULL) page->next->prev = page->prev;
+    munmap(page, page->slotSize);
+}
+
+static void freeSlot(VM *vm, Obj *object) {
+    SlabPage *page = pageOf(object);
+    size_t granule = granuleOf(object);
+    page->live[granule / 64] &= ~((uint64_t)1 << (granule % 64));
+    page->liveCnt--;
+
+    // an arena page counts as allocated until the sweep finds it empty, its
+    // slots are never reused
+    if (page->sizeClass == SLAB_ARENA) return;
+    vm->bytesAllocated -= page->slotSize;
+
+    if (page->sizeClass == SLAB_LARGE) {
+        // the sweep unmaps it once it is done with the page
+        if (!page->isUnswept) unmapLarge(vm, page);
+        return;
+    }
+
+    *(Obj **)object = page->freeList;
+    page->freeList = object;
+    POISON(object, page->slotSize);
+
+    // the sweep decides where unswept pages go once it is done with them
+    if (!page->inFreeList && !page->isUnswept) pushFreePage(vm, page);
+}
+
+// calls `fn` with every object in `page` and the pages after it
+static void eachObject(VM *vm, SlabPage *page, void (*fn)(VM *, Obj *)) {
+    while (page != NULL) {
+        SlabPage *next = page->next;
+        if (page->sizeClass == SLAB_LARGE) {
+            // freeing the object unmaps the whole page
+            fn(vm, (Obj *)((char *)page + SLAB_FIRST_SLOT));
+            page = next;
+            continue;
+        }
+
+        for (size_t i = 0; i < SLAB_WORDS; i++) {
+            uint64_t live = page->live[i];
+            while (live != 0) {
+                size_t granule = i * 64 + (size_t)__builtin_ctzll(live);
+                live &= live - 1;
+                fn(vm, objectAt(page, granule));
+            }
+        }
+        page = next;
+    }
+}
+
+static void freeChunks(VM *vm) {
+    for (int i = 0; i < vm->chunkCnt; i++) {
+        munmap(vm->chunks[i], SLAB_CHUNK_SIZE);
+    }
+    free(vm->chunks);
+    vm->chunks = NULL;
+    vm->chunkCnt = 0;
+    vm->chunkCap = 0;
+}
+
+static void markStep(VM *vm);
+static void sweepStep(VM *vm, int work);
+static void startMajor(VM *vm);
+
+double gcClock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// adds the time since `start` to a phase of a collection, the mutator was
+// stopped for all of it
+static void spend(GcCycle *cycle, double *phase, double start) {
+    double seconds = gcClock() - start;
+    *phase += seconds;
+    if (seconds > cycle->pause) cycle->pause = seconds;
+}
+
+static void beginCycle(VM *vm, GcCycle *cycle, bool major, double start) {
+    *cycle = (GcCycle){0};
+    cycle->major = major;
+    cycle->start = start - vm->gcStats.vmStart;
+    cycle->bytesBefore = vm->bytesAllocated;
+}
+
+static void endCycle(VM *vm, GcCycle *cycle) {
+    GcStats *stats = &vm->gcStats;
+    cycle->bytesAfter = cycle->bytesBefore - cycle->bytesFreed;
+    stats->cycles[stats->cnt++ % GC_CYCLES_KEPT] = *cycle;
+
+    GcCycle *total = &stats->totals[cycle->major];
+    stats->totalCnt[cycle->major]++;
+    total->markSeconds += cycle->markSeconds;
+    total->sweepSeconds += cycle->sweepSeconds;
+    if (cycle->pause > total->pause) total->pause = cycle->pause;
+    total->bytesFreed += cycle->bytesFreed;
+    for (int i = 0; i < OBJ_TYPE_CNT; i++) {
+        total->freed[i] += cycle->freed[i];
+    }
+}
+
+static void deferFree(VM *vm, void *ptr, size_t mapped) {
+    if (vm->deferredCap < vm->deferredCnt + 1) {
+        vm->deferredCap = GROW_CAP(vm->deferredCap);
+        vm->deferred = (DeferredFree *)realloc(
+            vm->deferred, sizeof(DeferredFree) * vm->deferredCap);
+
+        if (vm->deferred == NULL) exit(1);
+    }
+
+    vm->deferred[vm->deferredCnt++] = (DeferredFree){ptr, mapped};
+}
+
+static void freeDeferred(VM *vm) {
+    for (int i = 0; i < vm->deferredCnt; i++) {
+        DeferredFree *deferred = &vm->deferred[i];
+        if (deferred->mapped > 0) {
+            munmap(deferred->ptr, deferred->mapped);
+        } else {
+            free(deferred->ptr);
+        }
+    }
+    vm->deferredCnt = 0;
+}
+
+// does the collection work that is due whenever the heap grows
+static void collectIfNeeded(VM *vm) {
+    if (vm->gcPaused) return;
+    if (vm->gcMarking) {
+        // minor collections wait until the major one is done
+        markStep(vm);
+        return;
+    }
+
+    if (vm->gcArena) {
+        // nothing is collected until the heap is past its limit
+        GcPacer *pacer = &vm->pacer;
+        if (pacer->maxHeap > 0 && vm->bytesAllocated > pacer->maxHeap &&
+            vm->bytesAllocated > vm->nextMajorGC) {
+            collectGarbage(vm);
+        }
+        return;
+    }
+
+    if (vm->unswept != NULL) sweepStep(vm, GC_SWEEP_WORK);
+
+#ifdef DEBUG_STRESS_GC
+    // every allocation collects the young objects, and every so often a
+    // major collection starts too, so marking, sweeping and the weak objects
+    // of major ones get the same coverage
+    static unsigned stressAllocs = 0;
+    collectYoung(vm);
+    if (!vm->gcMarking && ++stressAllocs % GC_STRESS_MAJOR_EVERY == 0) {
+        startMajor(vm);
+    }
+    return;
 #endif
 
-#define GC_HEAP_GROW_FACTOR 2
+    if (vm->bytesAllocated > vm->nextGC) collectYoung(vm);
+}
 
-void *reallocate(VM *vm, void *ptr, size_t oldSize, size_t newSize) {
+static void countAllocation(VM *vm, size_t oldSize, size_t newSize) {
     vm->bytesAllocated += newSize - oldSize;
     if (newSize > oldSize) {
-#ifdef DEBUG_STRESS_GC
-        collectGarbage(vm);
-#endif
+        vm->pacer.allocated += newSize - oldSize;
+        collectIfNeeded(vm);
+    }
+}
+
+void *reallocate(VM *vm, void *ptr, size_t oldSize, size_t newSize) {
+    countAllocation(vm, oldSize, newSize);
 
-        if (vm->bytesAllocated > vm->nextGC) collectGarbage(vm);
+    // the marking thread could be reading the old buffer, so it is copied
+    // and only freed once the thread is done
+    if (vm->markerRunning && ptr != NULL) {
+        deferFree(vm, ptr, 0);
+        if (newSize == 0) return NULL;
+
+        void *result = malloc(newSize);
+        if (result == NULL) exit(1);
+        memcpy(result, ptr, oldSize < newSize ? oldSize : newSize);
+        return result;
     }
 
     if (newSize == 0) {
@@ -32,18 +509,113 @@ void *reallocate(VM *vm, void *ptr, size_t oldSize, size_t newSize) {
     return result;
 }
 
-void markObject(VM *vm, Obj *object) {
-    if (object == NULL) return;
-    if (object->isMarked) return;
+static size_t mappedSize(size_t size) {
+    return (size + 4095) & ~(size_t)4095;
+}
 
-#ifdef DEBUG_LOG_GC
-    printf("%p mark ", (void *)object);
-    printValue(OBJ_VAL(object));
-    printf("\n");
-#endif // ifdef DEBUG_LOG_GC
+void *reallocateBuffer(VM *vm, void *ptr, size_t oldSize, size_t newSize) {
+    bool wasLarge = oldSize >= LARGE_BUFFER_SIZE;
+    bool isLarge = newSize >= LARGE_BUFFER_SIZE;
+    if (!wasLarge && !isLarge) return reallocate(vm, ptr, oldSize, newSize);
+
+    countAllocation(vm, oldSize, newSize);
+    // the old pages stay where the marking thread can see them, until then
+    // the buffer is copied like any other
+    if (wasLarge && isLarge && !vm->markerRunning) {
+        void *result = mremap(ptr, mappedSize(oldSize), mappedSize(newSize),
+                              MREMAP_MAYMOVE);
+        if (result == MAP_FAILED) exit(1);
+        return result;
+    }
+
+    void *result = NULL;
+    if (isLarge) {
+        result = mmap(NULL, mappedSize(newSize), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (result == MAP_FAILED) exit(1);
+    } else if (newSize > 0) {
+        result = malloc(newSize);
+        if (result == NULL) exit(1);
+    }
+    if (ptr == NULL) return result;
+
+    if (result != NULL) {
+        memcpy(result, ptr, oldSize < newSize ? oldSize : newSize);
+    }
+    size_t mapped = wasLarge ? mappedSize(oldSize) : 0;
+    if (vm->markerRunning) {
+        deferFree(vm, ptr, mapped);
+    } else if (wasLarge) {
+        munmap(ptr, mapped);
+    } else {
+        free(ptr);
+    }
+    return result;
+}
+
+// in arena mode objects of every size are packed into the same page, which
+// a collection only gives back once all of them are dead
+static Obj *takeArena(VM *vm, size_t size) {
+    size_t span = (size + 7) & ~(size_t)7;
+    SlabPage *page = vm->arena;
+    if (page == NULL || page->bump + span > (char *)page + SLAB_PAGE_SIZE) {
+        // collecting drops the current page, so it comes first
+        countAllocation(vm, 0, SLAB_PAGE_SIZE);
+        page = takePage(vm);
+        page->freeList = NULL;
+        page->bump = (char *)page + SLAB_FIRST_SLOT;
+        page->slotSize = 0;
+        page->sizeClass = SLAB_ARENA;
+        page->liveCnt = 0;
+        page->inFreeList = false;
+        page->isUnswept = false;
+        page->next = vm->pages;
+        vm->pages = page;
+        vm->arena = page;
+    }
 
-    object->isMarked = true;
+    Obj *object = (Obj *)page->bump;
+    UNPOISON(object, span);
+    page->bump += span;
+    size_t granule = granuleOf(object);
+    page->live[granule / 64] |= (uint64_t)1 << (granule % 64);
+    page->liveCnt++;
+    return object;
+}
+
+Obj *allocateSlot(VM *vm, size_t size) {
+    if (vm->gcArena && size <= SLAB_MAX_SIZE) return takeArena(vm, size);
+
+    Obj *object;
+    if (size > SLAB_MAX_SIZE) {
+        size_t span = (SLAB_FIRST_SLOT + size + 4095) & ~(size_t)4095;
+        vm->bytesAllocated += span;
+        vm->pacer.allocated += span;
+        collectIfNeeded(vm);
+        object = takeLarge(vm, span);
+    } else {
+        int sizeClass = sizeClassOf(size);
+        vm->bytesAllocated += slotSizeOf(sizeClass);
+        vm->pacer.allocated += slotSizeOf(sizeClass);
+        collectIfNeeded(vm);
+        object = takeSlot(vm, sizeClass);
+    }
+    // there are no minor collections in arena mode
+    if (vm->gcArena) return object;
 
+    if (vm->youngCap < vm->youngCnt + 1) {
+        vm->youngCap = GROW_CAP(vm->youngCap);
+        vm->young = (Obj **)realloc(vm->young, sizeof(Obj *) * vm->youngCap);
+
+        if (vm->young == NULL) exit(1);
+    }
+    vm->young[vm->youngCnt++] = object;
+    return object;
+}
+
+static void dequePush(GrayDeque *deque, Obj *object);
+
+static void pushGray(VM *vm, Obj *object) {
     if (vm->grayCap < vm->grayCnt + 1) {
         vm->grayCap = GROW_CAP(vm->grayCap);
         vm->grayStack =
@@ -55,62 +627,118 @@ void markObject(VM *vm, Obj *object) {
     vm->grayStack[vm->grayCnt++] = object;
 }
 
+void markObject(VM *vm, Obj *object) {
+    if (object == NULL) return;
+    if (currentWorker != NULL) {
+        // only the worker that sets the bit grays it
+        if (!setMarked(object)) dequePush(&currentWorker->deque, object);
+        return;
+    }
+    // old objects count as marked in a minor collection
+    if (object->isOld && vm->collectingYoung) return;
+    if (setMarked(object)) return;
+
+#ifdef DEBUG_LOG_GC
+    printf("%p mark ", (void *)object);
+    printValue(OBJ_VAL(object));
+    printf("\n");
+#endif // ifdef DEBUG_LOG_GC
+
+    pushGray(vm, object);
+}
+
 void markValue(VM *vm, Value value) {
     if (IS_OBJ(value)) markObject(vm, AS_OBJ(value));
 }
 
-static void markArray(VM *vm, ValueArray *array) {
-    for (int i = 0; i < array->cnt; i++) {
-        markValue(vm, array->values[i]);
+static int markArray(VM *vm, ValueArray *array) {
+    // the array can be growing on another thread. the count is published
+    // last and buffers are only ever swapped for bigger ones, or NULL
+    int cnt = __atomic_load_n(&array->cnt, __ATOMIC_ACQUIRE);
+    Value *values = __atomic_load_n(&array->values, __ATOMIC_ACQUIRE);
+    if (values == NULL) return 0;
+
+    for (int i = 0; i < cnt; i++) {
+        markValue(vm, loadValue(&values[i]));
     }
+    return cnt;
 }
 
-static void blackenObject(VM *vm, Obj *object) {
+// returns the work it took, one for the object and one for each slot
+static int blackenObject(VM *vm, Obj *object) {
 #ifdef DEBUG_LOG_GC
     printf("%p blacken ", (void *)object);
     printValue(OBJ_VAL(object));
     printf("\n");
 #endif // ifdef DEBUG_LOG_GC
 
+    int slots = 0;
     switch (object->type) {
     case OBJ_BOUND_METHOD: {
         ObjBoundMethod *bound = (ObjBoundMethod *)object;
         markValue(vm, bound->receiver);
         markObject(vm, (Obj *)bound->method);
+        slots = 2;
     } break;
     case OBJ_CLASS: {
         ObjClass *klass = (ObjClass *)object;
         markObject(vm, (Obj *)klass->name);
-        markTable(vm, &klass->methods);
+        slots = 1 + markTable(vm, &klass->methods);
     } break;
     case OBJ_CLOSURE: {
         ObjClosure *closure = (ObjClosure *)object;
         markObject(vm, (Obj *)closure->fn);
         for (int i = 0; i < closure->upvalueCnt; i++) {
-            markObject(vm, (Obj *)closure->upvalues[i]);
+            markValue(vm, loadValue(&closure->upvalues[i]));
         }
+        slots = 1 + closure->upvalueCnt;
     } break;
     case OBJ_FUNCTION: {
         ObjFn *function = (ObjFn *)object;
-        markObject(vm, (Obj *)function->name);
-        markArray(vm, &function->chunk.constants);
+        // both can be set after the function is reachable
+        markObject(vm, (Obj *)__atomic_load_n(&function->name,
+                                              __ATOMIC_ACQUIRE));
+        markObject(vm, (Obj *)__atomic_load_n(&function->closure,
+                                              __ATOMIC_ACQUIRE));
+        slots = 2 + markArray(vm, &function->chunk.constants);
+        // compiling the body frees it, possibly while this runs on the
+        // marking thread
+        LazyBody *lazy = __atomic_load_n(&function->lazy, __ATOMIC_ACQUIRE);
+        if (lazy != NULL) {
+            markObject(vm, (Obj *)lazy->source);
+            slots += 1 + markArray(vm, &lazy->upvalueNames);
+        }
     } break;
     case OBJ_INSTANCE: {
         ObjInstance *instance = (ObjInstance *)object;
         markObject(vm, (Obj *)instance->klass);
-        markTable(vm, &instance->fields);
+        slots = 1 + markTable(vm, &instance->fields);
     } break;
     case OBJ_ERROR: {
         ObjString *msg = ((ObjError *)object)->msg;
         markObject(vm, (Obj *)msg);
+        slots = 1;
+    } break;
+    case OBJ_UPVALUE:
+        markValue(vm, loadValue(&((ObjUpvalue *)object)->closed));
+        slots = 1;
+        break;
+    case OBJ_ARRAY: {
+        // arrays of numbers and the like have nothing to trace
+        ObjArray *arr = (ObjArray *)object;
+        if (__atomic_load_n(&arr->hasRefs, __ATOMIC_RELAXED)) {
+            slots = markArray(vm, &arr->items);
+        }
     } break;
-    case OBJ_UPVALUE: markValue(vm, ((ObjUpvalue *)object)->closed); break;
-    case OBJ_ARRAY:   markArray(vm, &((ObjArray *)object)->items); break;
-    case OBJ_MAP:     markTable(vm, &((ObjMap *)object)->items); break;
+    case OBJ_MAP: slots = 2 * markDict(vm, &((ObjMap *)object)->items); break;
+    // left to processWeak once everything else is marked
+    case OBJ_WEAK_MAP:
+    case OBJ_WEAK_REF:
     case OBJ_RANGE:
     case OBJ_NATIVE:
     case OBJ_STRING:  break;
     }
+    return 1 + slots;
 }
 
 static void freeObject(VM *vm, Obj *object) {
@@ -121,47 +749,54 @@ static void freeObject(VM *vm, Obj *object) {
 #endif // ifdef DEBUG_LOG_GC
 
     switch (object->type) {
-    case OBJ_CLASS: {
-        ObjClass *klass = (ObjClass *)object;
-        freeTable(vm, &klass->methods);
-        FREE(ObjClass, object);
-    } break;
-    case OBJ_CLOSURE: {
-        ObjClosure *closure = (ObjClosure *)object;
-        FREE_ARRAY(ObjUpvalue *, closure->upvalues, closure->upvalueCnt);
-        FREE(ObjClosure, object);
-    } break;
+    case OBJ_CLASS: freeTable(vm, &((ObjClass *)object)->methods); break;
     case OBJ_FUNCTION: {
         ObjFn *function = (ObjFn *)object;
         freeChunk(vm, &function->chunk);
-        FREE(ObjFn, object);
-    } break;
-    case OBJ_INSTANCE: {
-        ObjInstance *instance = (ObjInstance *)object;
-        freeTable(vm, &instance->fields);
-        FREE(ObjInstance, object);
-    } break;
-    case OBJ_STRING: {
-        ObjString *string = (ObjString *)object;
-        FREE_ARRAY(char, string->chars, string->length + 1);
-        FREE(ObjString, object);
-    } break;
-    case OBJ_ARRAY: {
-        ObjArray *arr = (ObjArray *)object;
-        freeValueArray(vm, &arr->items);
-        FREE(ObjArray, object);
+        freeLazyBody(vm, function);
     } break;
-    case OBJ_MAP: {
-        ObjMap *map = (ObjMap *)object;
-        freeTable(vm, &map->items);
-        FREE(ObjMap, object);
-    } break;
-    case OBJ_NATIVE:       FREE(ObjNative, object); break;
-    case OBJ_UPVALUE:      FREE(ObjUpvalue, object); break;
-    case OBJ_BOUND_METHOD: FREE(ObjBoundMethod, object); break;
-    case OBJ_ERROR:        FREE(ObjError, object); break;
-    case OBJ_RANGE:        FREE(ObjRange, object); break;
+    case OBJ_INSTANCE: freeTable(vm, &((ObjInstance *)object)->fields); break;
+    case OBJ_ARRAY: freeValueArray(vm, &((ObjArray *)object)->items); break;
+    case OBJ_MAP:   freeDict(vm, &((ObjMap *)object)->items); break;
+    case OBJ_WEAK_MAP: freeTable(vm, &((ObjWeakMap *)object)->items); break;
+    case OBJ_WEAK_REF:
+    case OBJ_CLOSURE:
+    case OBJ_STRING:
+    case OBJ_NATIVE:
+    case OBJ_UPVALUE:
+    case OBJ_BOUND_METHOD:
+    case OBJ_ERROR:
+    case OBJ_RANGE: break;
+    }
+    freeSlot(vm, object);
+}
+
+void rememberObject(VM *vm, Obj *object) {
+    if (vm->rememberedCap < vm->rememberedCnt + 1) {
+        vm->rememberedCap = GROW_CAP(vm->rememberedCap);
+        vm->remembered = (Obj **)realloc(vm->remembered,
+                                         sizeof(Obj *) * vm->rememberedCap);
+
+        if (vm->remembered == NULL) exit(1);
     }
+
+    object->isRemembered = true;
+    vm->remembered[vm->rememberedCnt++] = object;
+}
+
+void growRoots(VM *vm) {
+    vm->tempCap = GROW_CAP(vm->tempCap);
+    vm->tempRoots =
+        (Value *)realloc(vm->tempRoots, sizeof(Value) * vm->tempCap);
+
+    if (vm->tempRoots == NULL) exit(1);
+}
+
+static void forgetRemembered(VM *vm) {
+    for (int i = 0; i < vm->rememberedCnt; i++) {
+        vm->remembered[i]->isRemembered = false;
+    }
+    vm->rememberedCnt = 0;
 }
 
 static void markRoots(VM *vm) {
@@ -225,54 +860,720 @@ static inline void traceReferences(VM *vm) {
     }
 }
 
-static void sweep(VM *vm) {
-    Obj *prv = NULL;
-    Obj *object = vm->objects;
-    while (object != NULL) {
-        if (object->isMarked) {
-            object->isMarked = false;
-            prv = object;
-            object = object->next;
+static DequeBuffer *newDequeBuffer(int64_t size, DequeBuffer *prev) {
+    DequeBuffer *buffer =
+        (DequeBuffer *)malloc(sizeof(DequeBuffer) + sizeof(Obj *) * size);
+    if (buffer == NULL) exit(1);
+    buffer->size = size;
+    buffer->prev = prev;
+    return buffer;
+}
+
+static void dequePush(GrayDeque *deque, Obj *object) {
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    DequeBuffer *buffer = __atomic_load_n(&deque->buffer, __ATOMIC_RELAXED);
+
+    if (bottom - top > buffer->size - 1) {
+        DequeBuffer *bigger = newDequeBuffer(buffer->size * 2, buffer);
+        for (int64_t i = top; i < bottom; i++) {
+            bigger->items[i & (bigger->size - 1)] =
+                buffer->items[i & (buffer->size - 1)];
+        }
+        __atomic_store_n(&deque->buffer, bigger, __ATOMIC_RELEASE);
+        buffer = bigger;
+    }
+
+    __atomic_store_n(&buffer->items[bottom & (buffer->size - 1)], object,
+                     __ATOMIC_RELAXED);
+    // a thief that sees the new bottom sees the object, and what the worker
+    // saw of it
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+}
+
+static Obj *dequeTake(GrayDeque *deque) {
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    DequeBuffer *buffer = __atomic_load_n(&deque->buffer, __ATOMIC_RELAXED);
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+    if (top > bottom) {
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    Obj *object = __atomic_load_n(&buffer->items[bottom & (buffer->size - 1)],
+                                  __ATOMIC_RELAXED);
+    if (top == bottom) {
+        // the last one, a thief might be taking it too
+        if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            object = NULL;
+        }
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return object;
+}
+
+// returns NULL if the deque is empty or another thief got there first
+static Obj *dequeSteal(GrayDeque *deque) {
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+    if (top >= bottom) return NULL;
+
+    DequeBuffer *buffer = __atomic_load_n(&deque->buffer, __ATOMIC_ACQUIRE);
+    Obj *object = __atomic_load_n(&buffer->items[top & (buffer->size - 1)],
+                                  __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    return object;
+}
+
+static bool dequeIsEmpty(GrayDeque *deque) {
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+    return top >= bottom;
+}
+
+// tries every other worker once, starting at a random one
+static Obj *stealWork(MarkWorker *worker) {
+    MarkWorkers *all = worker->all;
+    int cnt = __atomic_load_n(&all->cnt, __ATOMIC_ACQUIRE);
+    int start = (int)(rand_r(&worker->seed) % (unsigned int)cnt);
+    for (int i = 0; i < cnt; i++) {
+        MarkWorker *victim = &all->workers[(start + i) % cnt];
+        if (victim == worker) continue;
+
+        Obj *object = dequeSteal(&victim->deque);
+        if (object != NULL) return object;
+    }
+    return NULL;
+}
+
+static bool anyWork(MarkWorkers *all) {
+    int cnt = __atomic_load_n(&all->cnt, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < cnt; i++) {
+        if (!dequeIsEmpty(&all->workers[i].deque)) return true;
+    }
+    return false;
+}
+
+// marking is done once every worker is idle at the same time, as only a
+// working worker can gray more objects
+static void runWorker(MarkWorker *worker) {
+    MarkWorkers *all = worker->all;
+    currentWorker = worker;
+
+    for (;;) {
+        Obj *object;
+        while ((object = dequeTake(&worker->deque)) != NULL) {
+            blackenObject(worker->vm, object);
+        }
+
+        object = stealWork(worker);
+        if (object == NULL) {
+            __atomic_add_fetch(&all->idle, 1, __ATOMIC_SEQ_CST);
+            while (object == NULL) {
+                if (__atomic_load_n(&all->idle, __ATOMIC_SEQ_CST) ==
+                    __atomic_load_n(&all->cnt, __ATOMIC_SEQ_CST)) {
+                    currentWorker = NULL;
+                    return;
+                }
+                if (anyWork(all)) {
+                    __atomic_sub_fetch(&all->idle, 1, __ATOMIC_SEQ_CST);
+                    object = stealWork(worker);
+                    if (object != NULL) break;
+                    __atomic_add_fetch(&all->idle, 1, __ATOMIC_SEQ_CST);
+                }
+                sched_yield();
+            }
+        }
+        blackenObject(worker->vm, object);
+    }
+}
+
+static void *workerThread(void *arg) {
+    runWorker((MarkWorker *)arg);
+    return NULL;
+}
+
+// drains the gray stack with `workers` threads, the calling one included
+static void parallelTrace(VM *vm, int workers) {
+    if (workers <= 1) {
+        traceReferences(vm);
+        return;
+    }
+
+    MarkWorkers all = {.cnt = 1, .idle = 0};
+    for (int i = 0; i < workers; i++) {
+        all.workers[i] = (MarkWorker){
+            .vm = vm,
+            .all = &all,
+            .deque = {0, 0, newDequeBuffer(256, NULL)},
+            .seed = (unsigned int)i + 1,
+        };
+    }
+
+    // the others start out stealing from the calling thread
+    for (int i = 0; i < vm->grayCnt; i++) {
+        dequePush(&all.workers[0].deque, vm->grayStack[i]);
+    }
+    vm->grayCnt = 0;
+
+    pthread_t threads[GC_WORKERS_MAX];
+    for (int i = 1; i < workers; i++) {
+        __atomic_add_fetch(&all.cnt, 1, __ATOMIC_SEQ_CST);
+        if (pthread_create(&threads[i], NULL, workerThread,
+                           &all.workers[i]) != 0) {
+            __atomic_sub_fetch(&all.cnt, 1, __ATOMIC_SEQ_CST);
+            break;
+        }
+    }
+
+    runWorker(&all.workers[0]);
+
+    for (int i = 1; i < all.cnt; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; i < workers; i++) {
+        DequeBuffer *buffer = all.workers[i].deque.buffer;
+        while (buffer != NULL) {
+            DequeBuffer *prev = buffer->prev;
+            free(buffer);
+            buffer = prev;
+        }
+    }
+}
+
+// frees the unmarked young objects, the rest become old ones
+static bool isWeak(Obj *object) {
+    return object->type == OBJ_WEAK_MAP || object->type == OBJ_WEAK_REF;
+}
+
+static void pushWeak(VM *vm, Obj *object) {
+    if (vm->weakCap < vm->weakCnt + 1) {
+        vm->weakCap = GROW_CAP(vm->weakCap);
+        vm->weak = (Obj **)realloc(vm->weak, sizeof(Obj *) * vm->weakCap);
+
+        if (vm->weak == NULL) exit(1);
+    }
+    vm->weak[vm->weakCnt++] = object;
+}
+
+void trackWeak(VM *vm, Obj *object) {
+    if (isWeak(object)) pushWeak(vm, object);
+}
+
+// whether the collection under way is about to free `value`
+static bool isDying(VM *vm, Value value) {
+    if (!IS_OBJ(value)) return false;
+    Obj *object = AS_OBJ(value);
+    if (vm->collectingYoung && object->isOld) return false;
+    return !isMarked(object);
+}
+
+// an entry whose key is reachable keeps its value alive. returns whether
+// that marked anything new
+static bool markEphemerons(VM *vm, Obj *object) {
+    if (object->type != OBJ_WEAK_MAP) return false;
+    Table *table = &((ObjWeakMap *)object)->items;
+    int before = vm->grayCnt;
+    for (int i = 0; i < table->cap; i++) {
+        Entry *entry = &table->entries[i];
+        if (IS_EMPTY(entry->key) || isDying(vm, entry->key)) continue;
+        markValue(vm, entry->value);
+    }
+    return vm->grayCnt > before;
+}
+
+static void clearWeak(VM *vm, Obj *object) {
+    if (object->type == OBJ_WEAK_REF) {
+        ObjWeakRef *ref = (ObjWeakRef *)object;
+        if (isDying(vm, ref->target)) ref->target = NIL_VAL;
+    } else {
+        tableRemoveWhite(&((ObjWeakMap *)object)->items, vm->collectingYoung);
+    }
+}
+
+// runs once the strong references are traced. the young weak objects that
+// survive join the old ones in vm->weak. a minor collection only has to
+// look at those and the remembered ones, as an old weak map that was not
+// written to can't refer to young objects, and weak refs are never older
+// than their targets
+static void processWeak(VM *vm) {
+    int first = vm->weakCnt;
+    if (!vm->collectingYoung) {
+        // the dead ones are left for the sweep
+        int live = 0;
+        for (int i = 0; i < vm->weakCnt; i++) {
+            if (isMarked(vm->weak[i])) vm->weak[live++] = vm->weak[i];
+        }
+        vm->weakCnt = live;
+        first = 0;
+    }
+    for (int i = 0; i < vm->youngCnt; i++) {
+        Obj *object = vm->young[i];
+        if (isWeak(object) && isMarked(object)) pushWeak(vm, object);
+    }
+
+    // what a value keeps alive can be the key of another entry
+    bool marked = true;
+    while (marked) {
+        marked = false;
+        for (int i = first; i < vm->weakCnt; i++) {
+            marked |= markEphemerons(vm, vm->weak[i]);
+        }
+        for (int i = 0; vm->collectingYoung && i < vm->rememberedCnt; i++) {
+            marked |= markEphemerons(vm, vm->remembered[i]);
+        }
+        traceReferences(vm);
+    }
+
+    for (int i = first; i < vm->weakCnt; i++) {
+        clearWeak(vm, vm->weak[i]);
+    }
+    for (int i = 0; vm->collectingYoung && i < vm->rememberedCnt; i++) {
+        if (isWeak(vm->remembered[i])) clearWeak(vm, vm->remembered[i]);
+    }
+}
+
+static void sweepYoung(VM *vm) {
+    for (int i = 0; i < vm->youngCnt; i++) {
+        Obj *object = vm->young[i];
+        if (isMarked(object)) {
+            clearMark(object);
+            object->isOld = true;
         } else {
-            Obj *unreached = object;
-            object = object->next;
-            if (prv != NULL) {
-                prv->next = object;
-            } else {
-                vm->objects = object;
+            // only the young strings that died leave the intern set, so a
+            // minor collection costs nothing for the old ones
+            if (object->type == OBJ_STRING) {
+                internRemove(&vm->strings, (ObjString *)object);
             }
-            freeObject(vm, unreached);
+            vm->gcStats.minor.freed[object->type]++;
+            freeObject(vm, object);
         }
     }
+    vm->youngCnt = 0;
 }
 
-void collectGarbage(VM *vm) {
+// frees the objects of a page the last major collection did not mark, and
+// clears the marks of the rest in one go
+static void sweepPage(VM *vm, SlabPage *page) {
+    size_t before = vm->bytesAllocated;
+    for (size_t i = 0; i < SLAB_WORDS; i++) {
+        uint64_t dead = page->live[i] & ~page->marks[i];
+        while (dead != 0) {
+            size_t granule = i * 64 + (size_t)__builtin_ctzll(dead);
+            dead &= dead - 1;
+            Obj *object = objectAt(page, granule);
+            vm->gcStats.major.freed[object->type]++;
+            freeObject(vm, object);
+        }
+    }
+    memset(page->marks, 0, sizeof(page->marks));
+    page->isUnswept = false;
+    if (page->sizeClass == SLAB_ARENA && page->liveCnt == 0) {
+        vm->bytesAllocated -= SLAB_PAGE_SIZE;
+    }
+    vm->gcStats.major.bytesFreed += before - vm->bytesAllocated;
+
+    if (page->sizeClass == SLAB_LARGE) {
+        if (page->liveCnt == 0) {
+            munmap(page, page->slotSize);
+        } else {
+            pushLarge(vm, page);
+        }
+        return;
+    }
+
+    if (page->liveCnt == 0) {
+        POISON((char *)page + SLAB_FIRST_SLOT,
+               SLAB_PAGE_SIZE - SLAB_FIRST_SLOT);
+        page->next = vm->emptyPages;
+        vm->emptyPages = page;
+        return;
+    }
+
+    page->next = vm->pages;
+    vm->pages = page;
+    if (page->sizeClass != SLAB_ARENA && hasFreeSlots(page)) {
+        pushFreePage(vm, page);
+    }
+}
+
+static double average(double old, double sample) {
+    return old == 0 ? sample : old + (sample - old) * GC_PACE_WEIGHT;
+}
+
+// picks the heap size the next major collection starts at. it takes about
+// the bytes that survive it over the mark rate to run, and the mutator fills
+// the heap up to it at the allocation rate, so that is solved for the size
+// at which collecting takes cpuTarget of the time
+static void paceMajor(VM *vm) {
+    GcPacer *pacer = &vm->pacer;
+    GcCycle *cycle = &vm->gcStats.major;
+    double live = (double)vm->bytesAllocated;
+    double seconds = cycle->markSeconds + cycle->sweepSeconds;
+    if (cycle->bytesBefore > 0) {
+        double left = (double)(cycle->bytesBefore - cycle->bytesFreed);
+        pacer->survival =
+            average(pacer->survival, left / (double)cycle->bytesBefore);
+    }
+    if (seconds > 0) {
+        pacer->markRate = average(pacer->markRate, live / seconds);
+    }
+
+    double next = live * GC_HEAP_GROW_FACTOR;
+    if (pacer->allocRate > 0 && pacer->markRate > 0) {
+        double cpu = pacer->cpuTarget;
+        double k = pacer->allocRate * pacer->survival * (1 - cpu) /
+                   (cpu * pacer->markRate);
+        next = k < 1 ? live / (1 - k) : live * GC_MAX_GROWTH;
+    }
+    if (next > live * GC_MAX_GROWTH) next = live * GC_MAX_GROWTH;
+    if (next < live + NURSERY_SIZE) next = live + NURSERY_SIZE;
+    if (next < GC_MIN_HEAP) next = GC_MIN_HEAP;
+    if (vm->gcArena) {
+        // a page counts in full until everything in it is dead, so the heap
+        // can stay over its limit after collecting. it gets to grow by as
+        // much as it would without the limit, collectIfNeeded still waits
+        // for the heap to be past it as well
+        double grown = live * GC_HEAP_GROW_FACTOR;
+        if (next < grown) next = grown;
+    } else if (pacer->maxHeap > 0 && next > (double)pacer->maxHeap) {
+        // the limit on the heap comes first, but collecting again before
+        // there is anything new to collect would not get under it either
+        next = (double)pacer->maxHeap;
+        if (next < live + NURSERY_SIZE) next = live + NURSERY_SIZE;
+    }
+    vm->nextMajorGC = (size_t)next;
+
+    pacer->lastEnd = gcClock();
+    pacer->allocatedAtEnd = pacer->allocated;
+
 #ifdef DEBUG_LOG_GC
-    printf("-- gc begin\n");
+    printf("-- gc paced: %.0f bytes survived, %.0f bytes/s allocated, "
+           "%.0f bytes/s marked, next at %zu\n",
+           live, pacer->allocRate, pacer->markRate, vm->nextMajorGC);
+#endif // ifdef DEBUG_LOG_GC
+}
+
+// sweeps up to `work` of the pages the last major collection left behind
+static void sweepStep(VM *vm, int work) {
+    GcCycle *cycle = &vm->gcStats.major;
+    double start = gcClock();
+    while (vm->unswept != NULL && work-- > 0) {
+        SlabPage *page = vm->unswept;
+        vm->unswept = page->next;
+        sweepPage(vm, page);
+    }
+    spend(cycle, &cycle->sweepSeconds, start);
+
+    // the size of the heap is only known once the garbage is gone
+    if (vm->unswept == NULL && vm->nextMajorGC == SIZE_MAX) {
+        paceMajor(vm);
+        endCycle(vm, cycle);
+    }
+}
+
+#ifdef DEBUG_VERIFY_GC
+static void blackenOld(VM *vm, Obj *object) {
+    if (object->isOld) blackenObject(vm, object);
+}
+
+static void clearOld(VM *vm, Obj *object) {
+    (void)vm;
+    if (object->isOld) clearMark(object);
+}
+
+// a young object that only becomes reachable once every old object is
+// traced was missed by a write barrier
+static void verifyYoung(VM *vm) {
+    int marked = 0;
+    for (int i = 0; i < vm->youngCnt; i++) {
+        if (isMarked(vm->young[i])) marked++;
+    }
+
+    vm->collectingYoung = false;
+    eachObject(vm, vm->pages, blackenOld);
+    eachObject(vm, vm->largePages, blackenOld);
+    traceReferences(vm);
+
+    for (int i = 0; i < vm->youngCnt; i++) {
+        if (isMarked(vm->young[i])) marked--;
+    }
+    if (marked != 0) {
+        fprintf(stderr, "missed write barrier, %d young objects lost\n",
+                -marked);
+        abort();
+    }
+    eachObject(vm, vm->pages, clearOld);
+    eachObject(vm, vm->largePages, clearOld);
+}
+#endif // ifdef DEBUG_VERIFY_GC
+
+// a major collection waits for the minimum interval, unless the heap has
+// grown past its limit
+static bool majorIsDue(VM *vm) {
+    GcPacer *pacer = &vm->pacer;
+    if (vm->bytesAllocated <= vm->nextMajorGC) return false;
+    if (pacer->maxHeap > 0 && vm->bytesAllocated > pacer->maxHeap) return true;
+    return gcClock() - pacer->lastStart >= pacer->minInterval;
+}
+
+void collectYoung(VM *vm) {
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc begin\n");
     size_t before = vm->bytesAllocated;
 #endif // ifdef DEBUG_LOG_GC
 
+#ifdef DEBUG_VERIFY_GC
+    // dead objects that are not swept yet can point at freed ones, and
+    // their marks would count as young ones being reached
+    if (vm->unswept != NULL) sweepStep(vm, INT_MAX);
+#endif // ifdef DEBUG_VERIFY_GC
+
+    GcCycle *cycle = &vm->gcStats.minor;
+    double start = gcClock();
+    beginCycle(vm, cycle, false, start);
+    vm->collectingYoung = true;
     markRoots(vm);
+    // the remembered old objects are the only old ones that can point to
+    // young objects, they are treated as roots
+    for (int i = 0; i < vm->rememberedCnt; i++) {
+        blackenObject(vm, vm->remembered[i]);
+    }
     traceReferences(vm);
-    tableRemoveWhite(&vm->strings);
-    sweep(vm);
+    processWeak(vm);
+#ifdef DEBUG_VERIFY_GC
+    verifyYoung(vm);
+#endif // ifdef DEBUG_VERIFY_GC
+    double marked = gcClock();
+    cycle->markSeconds = marked - start;
+    sweepYoung(vm);
+    vm->collectingYoung = false;
+    forgetRemembered(vm);
+    cycle->sweepSeconds = gcClock() - marked;
+    cycle->pause = cycle->markSeconds + cycle->sweepSeconds;
+    cycle->bytesFreed = cycle->bytesBefore - vm->bytesAllocated;
+    endCycle(vm, cycle);
 
-    vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+    vm->nextGC = vm->bytesAllocated + NURSERY_SIZE;
 
 #ifdef DEBUG_LOG_GC
     printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
            before - vm->bytesAllocated, before, vm->bytesAllocated, vm->nextGC);
+    printf("-- minor gc end\n");
+#endif // ifdef DEBUG_LOG_GC
+
+    if (majorIsDue(vm)) startMajor(vm);
+}
+
+// only the gray stack and mark bits are touched until the mutator joins it,
+// anything written to in the meantime is in the remembered set
+static void *markThread(void *arg) {
+    VM *vm = (VM *)arg;
+    double start = gcClock();
+    parallelTrace(vm, vm->markerWorkers);
+    vm->pacer.markerSeconds = gcClock() - start;
+    __atomic_store_n(&vm->markDone, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// a major collection marks the whole heap, either on a thread of its own or
+// a few objects per allocation
+static void startMajor(VM *vm) {
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin\n");
+#endif // ifdef DEBUG_LOG_GC
+
+    // the mutator ran on its own since the last sweep ended
+    GcPacer *pacer = &vm->pacer;
+    double start = gcClock();
+    if (vm->unswept == NULL && pacer->lastEnd > 0 && start > pacer->lastEnd) {
+        double rate = (double)(pacer->allocated - pacer->allocatedAtEnd) /
+                      (start - pacer->lastEnd);
+        pacer->allocRate = average(pacer->allocRate, rate);
+    }
+
+    // the mark bits of the last collection have to be gone first
+    if (vm->unswept != NULL) sweepStep(vm, INT_MAX);
+    GcCycle *cycle = &vm->gcStats.major;
+    pacer->lastStart = start;
+    pacer->markerSeconds = 0;
+    beginCycle(vm, cycle, true, start);
+    start = gcClock();
+
+    // the old objects are all traced anyway, so the remembered set is reused
+    // to hold objects that were written to since
+    forgetRemembered(vm);
+    vm->gcMarking = true;
+    markRoots(vm);
+
+    // without a thread it falls back to marking in steps
+    if (vm->gcConcurrent) {
+        vm->markDone = false;
+        vm->markerWorkers = vm->gcWorkers;
+        vm->markerRunning =
+            pthread_create(&vm->marker, NULL, markThread, vm) == 0;
+    }
+    spend(cycle, &cycle->markSeconds, start);
+}
+
+// blackens gray objects until `work` slots are scanned, returns false once
+// nothing is left gray. the objects written to since they were blackened
+// stay in the remembered set until finishMajor, so one written to on every
+// step is still only scanned again once
+static bool markSome(VM *vm, int work) {
+    while (work > 0) {
+        if (vm->grayCnt == 0) return false;
+        work -= blackenObject(vm, vm->grayStack[--vm->grayCnt]);
+    }
+    return true;
+}
+
+// the marked objects that were written to have to be blackened again
+static void regrayRemembered(VM *vm) {
+    for (int i = 0; i < vm->rememberedCnt; i++) {
+        Obj *object = vm->remembered[i];
+        object->isRemembered = false;
+        if (isMarked(object)) pushGray(vm, object);
+    }
+    vm->rememberedCnt = 0;
+}
+
+// waits for the marking thread, after which the mutator owns the gray stack
+static void joinMarker(VM *vm) {
+    if (!vm->markerRunning) return;
+    pthread_join(vm->marker, NULL);
+    vm->markerRunning = false;
+}
+
+static void finishMajor(VM *vm) {
+#ifdef DEBUG_LOG_GC
+    size_t before = vm->bytesAllocated;
+#endif // ifdef DEBUG_LOG_GC
+
+    joinMarker(vm);
+    GcCycle *cycle = &vm->gcStats.major;
+    double start = gcClock();
+
+    // nothing tracks writes to the roots, so they are marked again. objects
+    // allocated since the start are white and only found through them
+    markRoots(vm);
+    regrayRemembered(vm);
+    parallelTrace(vm, vm->gcWorkers);
+    processWeak(vm);
+    internRemoveWhite(&vm->strings);
+    vm->gcMarking = false;
+    freeDeferred(vm);
+
+    // the pages are swept a few per allocation. young objects become old
+    // ones right away, so minor collections leave them alone
+    for (int i = 0; i < vm->youngCnt; i++) {
+        vm->young[i]->isOld = true;
+    }
+    vm->youngCnt = 0;
+
+    // nothing is allocated in a page before it is swept, as the new object
+    // would look like garbage
+    for (SlabPage *page = vm->pages; page != NULL; page = page->next) {
+        page->isUnswept = true;
+        page->inFreeList = false;
+    }
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        vm->slabs[i] = NULL;
+    }
+    vm->arena = NULL;
+    vm->unswept = vm->pages;
+    vm->pages = NULL;
+    while (vm->largePages != NULL) {
+        SlabPage *page = vm->largePages;
+        vm->largePages = page->next;
+        page->isUnswept = true;
+        page->next = vm->unswept;
+        vm->unswept = page;
+    }
+
+    // set again once the sweep is done
+    vm->nextMajorGC = SIZE_MAX;
+    vm->nextGC = vm->bytesAllocated + NURSERY_SIZE;
+    cycle->markSeconds += vm->pacer.markerSeconds;
+    spend(cycle, &cycle->markSeconds, start);
+
+#ifdef DEBUG_LOG_GC
+    printf("   %zu bytes allocated, the garbage is swept lazily\n", before);
     printf("-- gc end\n");
 #endif // ifdef DEBUG_LOG_GC
 }
 
-void freeObjects(VM *vm) {
-    Obj *object = vm->objects;
-    while (object != NULL) {
-        Obj *next = object->next;
-        freeObject(vm, object);
-        object = next;
+static void markStep(VM *vm) {
+    if (vm->markerRunning) {
+        if (__atomic_load_n(&vm->markDone, __ATOMIC_ACQUIRE)) finishMajor(vm);
+    } else {
+        GcCycle *cycle = &vm->gcStats.major;
+        double start = gcClock();
+        bool more = markSome(vm, vm->gcStepWork);
+        spend(cycle, &cycle->markSeconds, start);
+        if (!more) finishMajor(vm);
     }
+}
+
+void collectGarbage(VM *vm) {
+    if (!vm->gcMarking) startMajor(vm);
+    finishMajor(vm);
+    sweepStep(vm, INT_MAX);
+}
+
+void freeLazyBody(VM *vm, ObjFn *fn) {
+    LazyBody *lazy = fn->lazy;
+    if (lazy == NULL) return;
+    // the marking thread can still be reading it, so it is unlinked first
+    // and left as it is until the deferred frees
+    __atomic_store_n(&fn->lazy, NULL, __ATOMIC_RELEASE);
+    FREE_BUFFER(Value, lazy->upvalueNames.values, lazy->upvalueNames.cap);
+    FREE(LazyBody, lazy);
+}
+
+void freeObjects(VM *vm) {
+    joinMarker(vm);
+    freeDeferred(vm);
+    // puts every page back in the lists below
+    sweepStep(vm, INT_MAX);
+    eachObject(vm, vm->pages, freeObject);
+    eachObject(vm, vm->largePages, freeObject);
+    freeChunks(vm);
 
+    free(vm->young);
     free(vm->grayStack);
+    free(vm->remembered);
+    free(vm->weak);
+    free(vm->tempRoots);
+    free(vm->deferred);
+}
+
+void printGcStats(VM *vm) {
+    GcStats *stats = &vm->gcStats;
+    for (int major = 0; major < 2; major++) {
+        GcCycle *total = &stats->totals[major];
+        fprintf(stderr,
+                "gc: %d %s collections, %.3fs marking, %.3fs sweeping, "
+                "longest pause %.3fs, %zu bytes freed\n",
+                stats->totalCnt[major], major ? "major" : "minor",
+                total->markSeconds, total->sweepSeconds, total->pause,
+                total->bytesFreed);
+    }
+
+    fprintf(stderr, "gc: objects freed");
+    for (int i = 0; i < OBJ_TYPE_CNT; i++) {
+        size_t freed = stats->totals[0].freed[i] + stats->totals[1].freed[i];
+        if (freed > 0) {
+            fprintf(stderr, " %s %zu", ObjTypeString((ObjType)i) + 4, freed);
+        }
+    }
+    fprintf(stderr, "\n");
 }
@@ -9,6 +9,39 @@
 
 #define FREE(type, ptr) reallocate(vm, ptr, sizeof(type), 0)
 
+// the buffers of value arrays and tables, which can get big enough to be
+// mapped on their own
+#define ALLOCATE_BUFFER(type, cnt)                                             \
+    (type *)reallocateBuffer(vm, NULL, 0, sizeof(type) * (cnt))
+
+#define GROW_BUFFER(type, ptr, oldCnt, newCnt)                                 \
+    (type *)reallocateBuffer(vm, ptr, sizeof(type) * (oldCnt),                 \
+                             sizeof(type) * (newCnt))
+
+#define FREE_BUFFER(type, ptr, oldCnt)                                         \
+    reallocateBuffer(vm, (ptr), sizeof(type) * (oldCnt), 0)
+
+// bytes allocated between two minor collections
+#define NURSERY_SIZE (1024 * 1024)
+// the heap size the first major collection starts at, none starts earlier
+#define GC_MIN_HEAP (4 * 1024 * 1024)
+// slots a major collection scans per allocation by default
+#define GC_STEP_WORK 1024
+// pages swept per allocation after a major collection
+#define GC_SWEEP_WORK 1
+// the sizes objects are rounded up to, from 8 bytes to 16 kib. bigger ones
+// get memory of their own
+#define SLAB_CLASSES 56
+// the collections gcStats() can report on
+#define GC_CYCLES_KEPT 64
+// buffers from this size on get a mapping of their own, which grows by
+// moving pages instead of copying
+#define LARGE_BUFFER_SIZE (256 * 1024)
+// the most threads that mark the heap together
+#define GC_WORKERS_MAX 16
+// the share of the running time major collections aim to take
+#define GC_CPU_TARGET 0.25
+
 #define GROW_CAP(cap) ((cap) < 8 ? 8 : (cap) * 2)
 
 #define GROW_ARRAY(type, ptr, oldCnt, newCnt)                                  \
@@ -20,10 +53,96 @@
 
 typedef struct VM VM;
 
+// memory the marking thread might still be reading, `mapped` is the length
+// of a large buffer and 0 for anything from malloc
+typedef struct {
+    void *ptr;
+    size_t mapped;
+} DeferredFree;
+
+// decides when major collections start. the limits come from the command
+// line, the rest is measured as the program runs
+typedef struct {
+    // the heap size collections start at the latest, 0 for no limit
+    size_t maxHeap;
+    // the share of the running time collections may take
+    double cpuTarget;
+    // the fewest seconds from the start of one major collection to the next
+    double minInterval;
+
+    // bytes allocated since the start
+    size_t allocated;
+    // seconds the marking thread took, added once it is joined
+    double markerSeconds;
+    // averaged over the last collections: bytes allocated per second in
+    // between them, bytes of surviving heap a second of collecting gets
+    // through, and the share of the heap that survives
+    double allocRate;
+    double markRate;
+    double survival;
+    // when the last collection started and when its sweep ended
+    double lastStart;
+    double lastEnd;
+    size_t allocatedAtEnd;
+} GcPacer;
+
+// what one collection did. times are in seconds, `start` counts from when
+// the vm started
+typedef struct {
+    bool major;
+    double start;
+    double markSeconds;
+    double sweepSeconds;
+    // the longest the mutator was stopped for at a time
+    double pause;
+    // the heap after is what was left of the heap before, objects
+    // allocated in the meantime are not counted
+    size_t bytesBefore;
+    size_t bytesAfter;
+    size_t bytesFreed;
+    size_t freed[OBJ_TYPE_CNT];
+} GcCycle;
+
+typedef struct {
+    double vmStart;
+    // the latest collections, the next one goes at cnt % GC_CYCLES_KEPT
+    GcCycle cycles[GC_CYCLES_KEPT];
+    int cnt;
+    // the collections under way, a minor one can run while a major one
+    // is still sweeping
+    GcCycle minor;
+    GcCycle major;
+    // every finished collection added up, minor ones first. the pauses are
+    // the longest of any of them
+    GcCycle totals[2];
+    int totalCnt[2];
+} GcStats;
+
 void *reallocate(VM *vm, void *ptr, size_t oldSize, size_t newSize);
+// like reallocate, but buffers of LARGE_BUFFER_SIZE and up are mapped.
+// their sizes have to be exact, unlike with malloc
+void *reallocateBuffer(VM *vm, void *ptr, size_t oldSize, size_t newSize);
 void markObject(VM *vm, Obj *object);
 void markValue(VM *vm, Value value);
 void collectGarbage(VM *vm);
+void collectYoung(VM *vm);
+void rememberObject(VM *vm, Obj *object);
+// makes room for more temporary roots
+void growRoots(VM *vm);
+// no young list holds the objects of arena mode, so the weak ones have to be
+// known to the collector from the start
+void trackWeak(VM *vm, Obj *object);
+// takes memory for an object from the slab of its size. the object counts
+// as young until the next collection
+Obj *allocateSlot(VM *vm, size_t size);
+bool isMarked(Obj *object);
+// backs the pages objects are in with transparent huge pages
+void useHugePages(VM *vm);
 void freeObjects(VM *vm);
+// seconds on a clock that only goes forward
+double gcClock(void);
+// writes what the collections so far did to stderr
+void printGcStats(VM *vm);
+void freeLazyBody(VM *vm, ObjFn *fn);
 
 #endif // INCLUDE_CLOX_MEMORY_H_
@@ -1,4 +1,6 @@
 #include <math.h>
+#include <stdio.h>
+#include <string.h>
 #include <time.h>
 
 #include "common.h"
@@ -51,7 +53,7 @@ static Value appendNative(VM *vm, int argc, Value *args) {
 // delete an item from the array or map at index
 static Value deleteNative(VM *vm, int argc, Value *args) {
     CHECK_ARITY_NATIVE(2);
-    if (!(IS_ARRAY(args[0]) || IS_MAP(args[0]))) {
+    if (!(IS_ARRAY(args[0]) || IS_MAP(args[0]) || IS_WEAK_MAP(args[0]))) {
         return ERROR_VAL(false,
                          "Can only use 'delete' on maps and arrays, got %s",
                          typeofValue(args[0]));
@@ -70,7 +72,7 @@ static Value deleteNative(VM *vm, int argc, Value *args) {
             return ERROR_VAL(false, "index out of bounds");
         }
 
-        deleteFromArray(arr, index);
+        deleteFromArray(vm, arr, index);
         return NIL_VAL;
     } else if (IS_MAP(args[0])) {
         ObjMap *map = AS_MAP(args[0]);
@@ -80,7 +82,10 @@ static Value deleteNative(VM *vm, int argc, Value *args) {
                              typeofValue(key));
         }
 
-        tableDelete(&map->items, key);
+        dictDelete(&map->items, key);
+        return NIL_VAL;
+    } else if (IS_WEAK_MAP(args[0])) {
+        tableDelete(&AS_WEAK_MAP(args[0])->items, args[1]);
         return NIL_VAL;
     }
     return NIL_VAL;
@@ -99,9 +104,10 @@ static Value clearNative(VM *vm, int argc, Value *args) {
 
     Value v = args[0];
     if (IS_ARRAY(v)) {
-        AS_ARRAY(v)->items.cnt = 0;
+        __atomic_store_n(&AS_ARRAY(v)->items.cnt, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&AS_ARRAY(v)->hasRefs, false, __ATOMIC_RELAXED);
     } else if (IS_MAP(v)) {
-        tableClear(&AS_MAP(v)->items);
+        dictClear(&AS_MAP(v)->items);
     }
     return NIL_VAL;
 }
@@ -116,6 +122,8 @@ static Value lenNative(VM *vm, int argc, Value *args) {
         return NUMBER_VAL(AS_ARRAY(args[0])->items.cnt);
     } else if (IS_MAP(args[0])) {
         return NUMBER_VAL(AS_MAP(args[0])->items.cnt);
+    } else if (IS_WEAK_MAP(args[0])) {
+        return NUMBER_VAL(AS_WEAK_MAP(args[0])->items.cnt);
     }
     return ERROR_VAL(false,
                      "Can only take the length of strings, arrays, and maps");
@@ -144,6 +152,31 @@ static Value typeofNative(VM *vm, int argc, Value *args) {
     return OBJ_VAL(copyString(vm, str, (int)strnlen(str, 17)));
 }
 
+static Value weakMapNative(VM *vm, int argc, Value *args) {
+    (void)args;
+    CHECK_ARITY_NATIVE(0);
+    return OBJ_VAL(newWeakMap(vm));
+}
+
+static Value weakRefNative(VM *vm, int argc, Value *args) {
+    CHECK_ARITY_NATIVE(1);
+    if (!IS_OBJ(args[0])) {
+        return ERROR_VAL(false, "Can only make weak refs to objects, got %s",
+                         typeofValue(args[0]));
+    }
+    return OBJ_VAL(newWeakRef(vm, args[0]));
+}
+
+// the target of a weak ref, or nil once it has been collected
+static Value derefNative(VM *vm, int argc, Value *args) {
+    CHECK_ARITY_NATIVE(1);
+    if (!IS_WEAK_REF(args[0])) {
+        return ERROR_VAL(false, "Can only deref weak refs, got %s",
+                         typeofValue(args[0]));
+    }
+    return AS_WEAK_REF(args[0])->target;
+}
+
 static Value rangeNative(VM *vm, int argc, Value *args) {
     CHECK_ARITY_NATIVE(3);
 
@@ -200,6 +233,7 @@ static Value iterInitNative(VM *vm, int argc, Value *args) {
 
     ObjInstance *inst = AS_INSTANCE(args[-1]);
 
+    HANDLE_SCOPE(vm);
     ObjString *obj = CONST_STRING("obj");
     pushRoot(vm, OBJ_VAL(obj));
     ObjString *idx = CONST_STRING("_index");
@@ -211,22 +245,22 @@ static Value iterInitNative(VM *vm, int argc, Value *args) {
     Value index = NUMBER_VAL(0);
     if (IS_RANGE(args[0])) index = NUMBER_VAL(AS_RANGE(args[0])->start);
     tableSet(vm, &inst->fields, OBJ_VAL(idx), index);
-
-    popRoot(vm); // obj
-    popRoot(vm); // idx
+    writeBarrier(vm, (Obj *)inst);
 
     return OBJ_VAL(inst);
 }
 
-static Value iterNextNative(VM *vm, int argc, Value *args) {
-#define OBJ_HASH 3343205242
-#define IDX_HASH 1364385362
+// the hashes of the fields iterators keep their state in, worked out when
+// the natives are defined
+static uint32_t objHash;
+static uint32_t idxHash;
 
+static Value iterNextNative(VM *vm, int argc, Value *args) {
     CHECK_ARITY_NATIVE(0);
 
     ObjInstance *iter = AS_INSTANCE(args[-1]);
-    ObjString *_objStr = tableFindString(&iter->fields, "obj", 3, OBJ_HASH);
-    ObjString *_idxStr = tableFindString(&iter->fields, "_index", 6, IDX_HASH);
+    ObjString *_objStr = tableFindString(&iter->fields, "obj", 3, objHash);
+    ObjString *_idxStr = tableFindString(&iter->fields, "_index", 6, idxHash);
 
     Value obj = EMPTY_VAL, idx = EMPTY_VAL;
     tableGet(&iter->fields, OBJ_VAL(_objStr), &obj);
@@ -247,11 +281,12 @@ static Value iterNextNative(VM *vm, int argc, Value *args) {
         n = (int)AS_RANGE(obj)->step;
     } break;
     case OBJ_MAP: {
-        Table map = AS_MAP(obj)->items;
-        for (; index < map.cap; index++) {
+        // in the order the keys were added, past the deleted ones
+        Dict map = AS_MAP(obj)->items;
+        for (; index < dictUsed(&map); index++) {
             if (!IS_EMPTY(map.entries[index].key)) break;
         }
-        result = BOOL_VAL(index < map.cap);
+        result = BOOL_VAL(index < dictUsed(&map));
     } break;
     default: return FALSE_VAL;
     }
@@ -261,20 +296,14 @@ static Value iterNextNative(VM *vm, int argc, Value *args) {
     tableSet(vm, &iter->fields, OBJ_VAL(_idxStr), NUMBER_VAL(index + n));
 
     return result;
-
-#undef OBJ_HASH
-#undef IDX_HASH
 }
 
 static Value iterValueNative(VM *vm, int argc, Value *args) {
-#define OBJ_HASH 3343205242
-#define IDX_HASH 1364385362
-
     CHECK_ARITY_NATIVE(0);
 
     ObjInstance *iter = AS_INSTANCE(args[-1]);
-    ObjString *_objStr = tableFindString(&iter->fields, "obj", 3, OBJ_HASH);
-    ObjString *_idxStr = tableFindString(&iter->fields, "_index", 6, IDX_HASH);
+    ObjString *_objStr = tableFindString(&iter->fields, "obj", 3, objHash);
+    ObjString *_idxStr = tableFindString(&iter->fields, "_index", 6, idxHash);
 
     Value obj = EMPTY_VAL, idx = EMPTY_VAL;
     tableGet(&iter->fields, OBJ_VAL(_objStr), &obj);
@@ -295,20 +324,14 @@ static Value iterValueNative(VM *vm, int argc, Value *args) {
 #pragma GCC diagnostic pop
 
     return NIL_VAL;
-
-#undef OBJ_HASH
-#undef IDX_HASH
 }
 
 static Value iterIndexNative(VM *vm, int argc, Value *args) {
-#define OBJ_HASH 3343205242
-#define IDX_HASH 1364385362
-
     CHECK_ARITY_NATIVE(0);
 
     ObjInstance *iter = AS_INSTANCE(args[-1]);
-    ObjString *_idxStr = tableFindString(&iter->fields, "_index", 6, IDX_HASH);
-    ObjString *_objStr = tableFindString(&iter->fields, "obj", 3, OBJ_HASH);
+    ObjString *_idxStr = tableFindString(&iter->fields, "_index", 6, idxHash);
+    ObjString *_objStr = tableFindString(&iter->fields, "obj", 3, objHash);
 
     Value obj = EMPTY_VAL, idx = EMPTY_VAL;
     tableGet(&iter->fields, OBJ_VAL(_idxStr), &idx);
@@ -321,13 +344,75 @@ static Value iterIndexNative(VM *vm, int argc, Value *args) {
         return NUMBER_VAL((index - step) / step);
     }
     return NUMBER_VAL(index - 1);
+}
+
+// map[name] = value, both are kept alive while the map grows
+static void setField(VM *vm, ObjMap *map, const char *name, Value value) {
+    HANDLE_SCOPE(vm);
+    pushRoot(vm, value);
+    ObjString *key = copyString(vm, name, (int)strlen(name));
+    pushRoot(vm, OBJ_VAL(key));
+    dictSet(vm, &map->items, OBJ_VAL(key), value);
+    writeBarrier(vm, (Obj *)map);
+}
+
+static Value cycleToMap(VM *vm, const GcCycle *cycle) {
+    HANDLE_SCOPE(vm);
+    ObjMap *map = newMap(vm);
+    pushRoot(vm, OBJ_VAL(map));
+    const char *kind = cycle->major ? "major" : "minor";
+    setField(vm, map, "kind", OBJ_VAL(copyString(vm, kind, 5)));
+    setField(vm, map, "start", NUMBER_VAL(cycle->start));
+    setField(vm, map, "mark", NUMBER_VAL(cycle->markSeconds));
+    setField(vm, map, "sweep", NUMBER_VAL(cycle->sweepSeconds));
+    setField(vm, map, "pause", NUMBER_VAL(cycle->pause));
+    setField(vm, map, "before", NUMBER_VAL((double)cycle->bytesBefore));
+    setField(vm, map, "after", NUMBER_VAL((double)cycle->bytesAfter));
+
+    // only the types that had any freed
+    ObjMap *freed = newMap(vm);
+    setField(vm, map, "freed", OBJ_VAL(freed));
+    for (int i = 0; i < OBJ_TYPE_CNT; i++) {
+        if (cycle->freed[i] == 0) continue;
+        setField(vm, freed, ObjTypeString((ObjType)i) + 4,
+                 NUMBER_VAL((double)cycle->freed[i]));
+    }
+    return OBJ_VAL(map);
+}
 
-#undef OBJ_HASH
-#undef IDX_HASH
+// the latest collections, as maps of what each one did, in the order they
+// ended. a major one sweeps lazily, so it can end after minor ones that
+// started after it
+static Value gcStatsNative(VM *vm, int argc, Value *args) {
+    (void)args;
+    CHECK_ARITY_NATIVE(0);
+
+    // building the result collects garbage too, which would overwrite the
+    // records being read. so they are copied first, to memory the collector
+    // does not hand out
+    GcStats *stats = &vm->gcStats;
+    int cnt = stats->cnt < GC_CYCLES_KEPT ? stats->cnt : GC_CYCLES_KEPT;
+    int first = stats->cnt - cnt;
+    GcCycle cycles[GC_CYCLES_KEPT];
+    for (int i = 0; i < cnt; i++) {
+        cycles[i] = stats->cycles[(first + i) % GC_CYCLES_KEPT];
+    }
+
+    HANDLE_SCOPE(vm);
+    ObjArray *arr = newArray(vm);
+    pushRoot(vm, OBJ_VAL(arr));
+    for (int i = 0; i < cnt; i++) {
+        Value cycle = cycleToMap(vm, &cycles[i]);
+        pushRoot(vm, cycle);
+        appendToArray(vm, arr, cycle);
+    }
+
+    return OBJ_VAL(arr);
 }
 
 static void defineNativeClass(VM *vm, const NativeClassDecl decl) {
     // add class to globals
+    HANDLE_SCOPE(vm);
     ObjString *kname = copyString(vm, decl.name, decl.len);
     pushRoot(vm, OBJ_VAL(kname));
     ObjClass *klass = newClass(vm, kname);
@@ -339,20 +424,18 @@ static void defineNativeClass(VM *vm, const NativeClassDecl decl) {
     // add native functions to the class
     for (int i = 0; i < decl.numFns; i++) {
         NativeDecl fn = decl.fns[i];
+        HANDLE_SCOPE(vm);
         ObjString *fname = copyString(vm, fn.name, fn.len);
         pushRoot(vm, OBJ_VAL(fname));
         ObjNative *native = newNative(vm, fn.fn);
         pushRoot(vm, OBJ_VAL(native));
         tableSet(vm, &klass->methods, OBJ_VAL(fname), OBJ_VAL(native));
-        popRoot(vm); // fn name
-        popRoot(vm); // fn
+        writeBarrier(vm, (Obj *)klass);
     }
-
-    popRoot(vm); // class name
-    popRoot(vm); // class
 }
 
 static void defineNative(VM *vm, const NativeDecl decl) {
+    HANDLE_SCOPE(vm);
     ObjString *nativeName = copyString(vm, decl.name, decl.len);
     pushRoot(vm, OBJ_VAL(nativeName));
     ObjNative *fn = newNative(vm, decl.fn);
@@ -361,34 +444,84 @@ static void defineNative(VM *vm, const NativeDecl decl) {
     writeValueArray(vm, &vm->globalValues, OBJ_VAL(fn));
     tableSet(vm, &vm->globalNames, OBJ_VAL(nativeName),
              NUMBER_VAL((double)index));
-    popRoot(vm); // pop native ptr
-    popRoot(vm); // pop native name
 }
 
+static const NativeDecl NATIVE_FNS[] = {
+    NATIVE_FN("len", lenNative),       NATIVE_FN("clock", clockNative),
+    NATIVE_FN("error", errorNative),   NATIVE_FN("clear", clearNative),
+    NATIVE_FN("delete", deleteNative), NATIVE_FN("append", appendNative),
+    NATIVE_FN("typeof", typeofNative), NATIVE_FN("range", rangeNative),
+    NATIVE_FN("gcStats", gcStatsNative), NATIVE_FN("WeakMap", weakMapNative),
+    NATIVE_FN("WeakRef", weakRefNative), NATIVE_FN("deref", derefNative),
+};
+
+static const NativeDecl ITER_FNS[] = {
+    NATIVE_FN("init", iterInitNative),
+    NATIVE_FN("next", iterNextNative),
+    NATIVE_FN("value", iterValueNative),
+    NATIVE_FN("index", iterIndexNative),
+};
+
+static const NativeClassDecl NATIVE_CLASSES[] = {
+    NATIVE_CLASS("Iter", ITER_FNS),
+};
+
 void defineAllNatives(VM *vm) {
-    static const NativeDecl NATIVE_FNS[] = {
-        NATIVE_FN("len", lenNative),       NATIVE_FN("clock", clockNative),
-        NATIVE_FN("error", errorNative),   NATIVE_FN("clear", clearNative),
-        NATIVE_FN("delete", deleteNative), NATIVE_FN("append", appendNative),
-        NATIVE_FN("typeof", typeofNative), NATIVE_FN("range", rangeNative),
-    };
+    objHash = hashString("obj", 3);
+    idxHash = hashString("_index", 6);
 
     for (size_t i = 0; i < ARRAY_LEN(NATIVE_FNS); i++) {
         defineNative(vm, NATIVE_FNS[i]);
     }
 
-    static const NativeDecl ITER_FNS[] = {
-        NATIVE_FN("init", iterInitNative),
-        NATIVE_FN("next", iterNextNative),
-        NATIVE_FN("value", iterValueNative),
-        NATIVE_FN("index", iterIndexNative),
-    };
+    for (size_t i = 0; i < ARRAY_LEN(NATIVE_CLASSES); i++) {
+        defineNativeClass(vm, NATIVE_CLASSES[i]);
+    }
+}
 
-    static const NativeClassDecl NATIVE_CLASSES[] = {
-        NATIVE_CLASS("Iter", ITER_FNS),
-    };
+int nativeName(NativeFn fn, char *buf, int size) {
+    for (size_t i = 0; i < ARRAY_LEN(NATIVE_FNS); i++) {
+        if (NATIVE_FNS[i].fn == fn) {
+            return snprintf(buf, size, "%s", NATIVE_FNS[i].name);
+        }
+    }
 
     for (size_t i = 0; i < ARRAY_LEN(NATIVE_CLASSES); i++) {
-        defineNativeClass(vm, NATIVE_CLASSES[i]);
+        NativeClassDecl klass = NATIVE_CLASSES[i];
+        for (int j = 0; j < klass.numFns; j++) {
+            if (klass.fns[j].fn == fn) {
+                return snprintf(buf, size, "%s.%s", klass.name,
+                                klass.fns[j].name);
+            }
+        }
+    }
+    return -1;
+}
+
+NativeFn findNative(const char *name, int len) {
+    for (size_t i = 0; i < ARRAY_LEN(NATIVE_FNS); i++) {
+        NativeDecl decl = NATIVE_FNS[i];
+        if (decl.len == len && memcmp(decl.name, name, len) == 0) {
+            return decl.fn;
+        }
+    }
+
+    for (size_t i = 0; i < ARRAY_LEN(NATIVE_CLASSES); i++) {
+        NativeClassDecl klass = NATIVE_CLASSES[i];
+        if (len <= klass.len || name[klass.len] != '.' ||
+            memcmp(klass.name, name, klass.len) != 0) {
+            continue;
+        }
+
+        const char *method = name + klass.len + 1;
+        int methodLen = len - klass.len - 1;
+        for (int j = 0; j < klass.numFns; j++) {
+            NativeDecl decl = klass.fns[j];
+            if (decl.len == methodLen &&
+                memcmp(decl.name, method, methodLen) == 0) {
+                return decl.fn;
+            }
+        }
     }
+    return NULL;
 }
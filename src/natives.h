@@ -5,4 +5,9 @@
 
 void defineAllNatives(VM *vm);
 
+// heap images refer to natives by name, methods of native classes are
+// named "Class.method". returns the length of the name or -1 if unknown
+int nativeName(NativeFn fn, char *buf, int size);
+NativeFn findNative(const char *name, int len);
+
 #endif // INCLUDE_SRC_NATIVE_H_
@@ -1,9 +1,11 @@
+#include <assert.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "chunk.h"
 #include "common.h"
+#include "intern.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
@@ -13,13 +15,16 @@
 #define ALLOCATE_OBJ(type, objectType)                                         \
     (type *)allocateObject(vm, sizeof(type), objectType)
 
+// for objects that end in a flexible array of `extra` bytes
+#define ALLOCATE_FLEX(type, objectType, extra)                                 \
+    (type *)allocateObject(vm, sizeof(type) + (extra), objectType)
+
 static Obj *allocateObject(VM *vm, size_t size, ObjType type) {
-    Obj *object = (Obj *)reallocate(vm, NULL, 0, size);
+    Obj *object = allocateSlot(vm, size);
     object->type = type;
-    object->isMarked = false;
-
-    object->next = vm->objects;
-    vm->objects = object;
+    object->isOld = false;
+    object->isRemembered = false;
+    if (vm->gcArena) trackWeak(vm, object);
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %s\n", (void *)object, size,
            ObjTypeString(type));
@@ -42,15 +47,23 @@ ObjClass *newClass(VM *vm, ObjString *name) {
 }
 
 ObjClosure *newClosure(VM *vm, ObjFn *function) {
-    ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue *, function->upvalueCnt);
-    for (int i = 0; i < function->upvalueCnt; i++) {
-        upvalues[i] = NULL;
+    // closures that capture nothing can't be told apart, so there is one
+    if (function->upvalueCnt == 0 && function->closure != NULL) {
+        return function->closure;
     }
 
-    ObjClosure *closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+    ObjClosure *closure = ALLOCATE_FLEX(ObjClosure, OBJ_CLOSURE,
+                                        sizeof(Value) * function->upvalueCnt);
     closure->fn = function;
-    closure->upvalues = upvalues;
     closure->upvalueCnt = function->upvalueCnt;
+    for (int i = 0; i < function->upvalueCnt; i++) {
+        closure->upvalues[i] = NIL_VAL;
+    }
+
+    if (function->upvalueCnt == 0) {
+        __atomic_store_n(&function->closure, closure, __ATOMIC_RELEASE);
+        writeBarrier(vm, (Obj *)function);
+    }
     return closure;
 }
 
@@ -59,6 +72,10 @@ ObjFn *newFunction(VM *vm) {
     function->arity = 0;
     function->upvalueCnt = 0;
     function->name = NULL;
+    function->lazy = NULL;
+    function->cached = NULL;
+    function->compiled = NULL;
+    function->closure = NULL;
     initChunk(&function->chunk);
     return function;
 }
@@ -76,38 +93,105 @@ ObjNative *newNative(VM *vm, NativeFn function) {
     return native;
 }
 
-static ObjString *allocateString(VM *vm, char *chars, int length,
+static ObjString *allocateString(VM *vm, const char *chars, int length,
                                  uint32_t hash) {
-    ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+    ObjString *string = ALLOCATE_FLEX(ObjString, OBJ_STRING, length + 1);
     string->length = length;
-    string->chars = chars;
     string->hash = hash;
+    memcpy(string->chars, chars, length);
+    string->chars[length] = '\0';
+    internAdd(&vm->strings, string);
+    return string;
+}
 
-    pushRoot(vm, OBJ_VAL(string)); // make sure not collect by mistake
-    tableSet(vm, &vm->strings, OBJ_VAL(string), NIL_VAL);
-    popRoot(vm);
+// wyhash, which reads the string 8 bytes at a time and mixes them with 64 by
+// 64 bit multiplies, three lanes at once for long strings
+static const uint64_t WY[4] = {
+    0x2d358dccaa6c78a5ull,
+    0x8bb84b93962eacc9ull,
+    0x4b33a62ed433d4a3ull,
+    0x4d5a2da51de1aa47ull,
+};
+
+// the low and high halves of the 128 bit product
+static inline void wyMul(uint64_t *a, uint64_t *b) {
+    __extension__ unsigned __int128 r = (unsigned __int128)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+}
 
-    return string;
+static inline uint64_t wyMix(uint64_t a, uint64_t b) {
+    wyMul(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
 }
 
-static uint32_t hashString(const char *key, int length) {
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < length; i++) {
-        hash ^= (uint8_t)key[i];
-        hash *= 16777619;
+uint32_t hashString(const char *key, int length) {
+    const uint8_t *p = (const uint8_t *)key;
+    size_t len = (size_t)length;
+    uint64_t seed = wyMix(WY[0] ^ hashSeed, WY[1]);
+    uint64_t a = 0, b = 0;
+    if (len <= 16) {
+        if (len >= 4) {
+            // two overlapping reads from each end cover all of it
+            size_t mid = (len >> 3) << 2;
+            a = (read32(p) << 32) | read32(p + mid);
+            b = (read32(p + len - 4) << 32) | read32(p + len - 4 - mid);
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) |
+                p[len - 1];
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t seed1 = seed, seed2 = seed;
+            do {
+                seed = wyMix(read64(p) ^ WY[1], read64(p + 8) ^ seed);
+                seed1 = wyMix(read64(p + 16) ^ WY[2], read64(p + 24) ^ seed1);
+                seed2 = wyMix(read64(p + 32) ^ WY[3], read64(p + 40) ^ seed2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while (i > 16) {
+            seed = wyMix(read64(p) ^ WY[1], read64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        // the last 16 bytes, which can overlap the ones already mixed in
+        a = read64(p + i - 16);
+        b = read64(p + i - 8);
     }
-    return hash;
+
+    a ^= WY[1];
+    b ^= seed;
+    wyMul(&a, &b);
+    return (uint32_t)wyMix(a ^ WY[0] ^ len, b ^ WY[1]);
 }
 
 // used for dynamically allocated items
 ObjString *takeString(VM *vm, char *chars, int length) {
     uint32_t hash = hashString(chars, length);
-    ObjString *interned = tableFindString(&vm->strings, chars, length, hash);
+    ObjString *interned = internFind(&vm->strings, chars, length, hash);
     if (interned != NULL) {
         FREE_ARRAY(char, chars, length + 1);
         return interned;
     }
-    return allocateString(vm, chars, length, hash);
+    ObjString *string = allocateString(vm, chars, length, hash);
+    FREE_ARRAY(char, chars, length + 1);
+    return string;
 }
 
 // used to extend the lifetime of the string for the vm
@@ -115,12 +199,9 @@ ObjString *takeString(VM *vm, char *chars, int length) {
 // if its a static string
 ObjString *copyString(VM *vm, const char *chars, int length) {
     uint32_t hash = hashString(chars, length);
-    ObjString *interned = tableFindString(&vm->strings, chars, length, hash);
+    ObjString *interned = internFind(&vm->strings, chars, length, hash);
     if (interned != NULL) return interned;
-    char *heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-    return allocateString(vm, heapChars, length, hash);
+    return allocateString(vm, chars, length, hash);
 }
 
 ObjError *newError(VM *vm, bool recoverable, const char *fmt, ...) {
@@ -134,10 +215,10 @@ ObjError *newError(VM *vm, bool recoverable, const char *fmt, ...) {
     vsnprintf(buf, len + 1, fmt, va);
     va_end(va);
 
+    HANDLE_SCOPE(vm);
     ObjString *msg = takeString(vm, buf, len);
     pushRoot(vm, OBJ_VAL(msg)); // keep msg safe
     ObjError *err = ALLOCATE_OBJ(ObjError, OBJ_ERROR);
-    popRoot(vm);
 
     // set up error
     err->msg = msg;
@@ -145,6 +226,13 @@ ObjError *newError(VM *vm, bool recoverable, const char *fmt, ...) {
     return err;
 }
 
+// the slab size classes are 8 bytes apart, these keep the common objects
+// from creeping into the next one
+static_assert(sizeof(ObjInstance) == 32, "instances do not fit in 32 bytes");
+static_assert(sizeof(ObjClass) == 32, "classes do not fit in 32 bytes");
+static_assert(sizeof(ObjMap) == 24, "maps do not fit in 24 bytes");
+static_assert(sizeof(ObjArray) == 24, "arrays do not fit in 24 bytes");
+
 ObjUpvalue *newUpvalue(VM *vm, Value *slot) {
     ObjUpvalue *upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
     upvalue->closed = NIL_VAL;
@@ -155,7 +243,7 @@ ObjUpvalue *newUpvalue(VM *vm, Value *slot) {
 
 ObjMap *newMap(VM *vm) {
     ObjMap *map = ALLOCATE_OBJ(ObjMap, OBJ_MAP);
-    initTable(&map->items);
+    initDict(&map->items);
     return map;
 }
 
@@ -165,6 +253,18 @@ ObjArray *newArray(VM *vm) {
     return arr;
 }
 
+ObjWeakMap *newWeakMap(VM *vm) {
+    ObjWeakMap *map = ALLOCATE_OBJ(ObjWeakMap, OBJ_WEAK_MAP);
+    initTable(&map->items);
+    return map;
+}
+
+ObjWeakRef *newWeakRef(VM *vm, Value target) {
+    ObjWeakRef *ref = ALLOCATE_OBJ(ObjWeakRef, OBJ_WEAK_REF);
+    ref->target = target;
+    return ref;
+}
+
 ObjRange *newRange(VM *vm, double start, double stop, double step) {
     ObjRange *range = ALLOCATE_OBJ(ObjRange, OBJ_RANGE);
     range->start = start;
@@ -194,9 +294,9 @@ void printObject(Value value) {
     } break;
     case OBJ_MAP: {
         printf("{");
-        Table elms = AS_MAP(value)->items;
+        Dict elms = AS_MAP(value)->items;
         bool first = true;
-        for (int i = 0; i < elms.cap; i++) {
+        for (int i = 0; i < dictUsed(&elms); i++) {
             Entry entry = elms.entries[i];
             if (IS_EMPTY(entry.key)) continue;
 
@@ -225,6 +325,8 @@ void printObject(Value value) {
     case OBJ_STRING:   printf("%s", AS_CSTRING(value)); break;
     case OBJ_ERROR:    printf("%s", AS_ERROR_MSG(value)); break;
     case OBJ_UPVALUE:  printf("upvalue"); break;
+    case OBJ_WEAK_MAP: printf("<weak map>"); break;
+    case OBJ_WEAK_REF: printf("<weak ref>"); break;
     }
 }
 
@@ -246,11 +348,11 @@ int objectStringLength(Value value) {
         return total;
     }
     case OBJ_MAP: {
-        Table elms = AS_MAP(value)->items;
+        Dict elms = AS_MAP(value)->items;
         if (elms.cnt == 0) return 2;
         // int total = 2 + (elms.cnt * 2) + ((elms.cnt - 1) * 2);
         int total = elms.cnt * 4;
-        for (int i = 0; i < elms.cap; i++) {
+        for (int i = 0; i < dictUsed(&elms); i++) {
             Entry entry = elms.entries[i];
             if (IS_EMPTY(entry.key)) continue;
 
@@ -273,6 +375,8 @@ int objectStringLength(Value value) {
     case OBJ_CLASS:        return AS_CLASS(value)->name->length;
     case OBJ_STRING:       return AS_STRING(value)->length;
     case OBJ_ERROR:        return AS_ERROR(value)->msg->length;
+    case OBJ_WEAK_MAP:
+    case OBJ_WEAK_REF:     return 10;
     }
     UNREACHABLE();
     return -1;
@@ -309,7 +413,7 @@ int objectToStringX(Value value, char *buf, int offset) {
         return offset + 1;
     }
     case OBJ_MAP: {
-        Table elms = AS_MAP(value)->items;
+        Dict elms = AS_MAP(value)->items;
         if (elms.cnt == 0) {
             snprintf(buf + offset, 3, "{}");
             return offset + 2;
@@ -318,7 +422,7 @@ int objectToStringX(Value value, char *buf, int offset) {
         snprintf(buf + offset, 2, "{");
         offset++;
         bool first = true;
-        for (int i = 0; i < elms.cap; i++) {
+        for (int i = 0; i < dictUsed(&elms); i++) {
             Entry entry = elms.entries[i];
             if (IS_EMPTY(entry.key)) continue;
 
@@ -373,6 +477,12 @@ int objectToStringX(Value value, char *buf, int offset) {
         snprintf(buf + offset, 12, "<native fn>");
         return offset + 11;
     case OBJ_UPVALUE: snprintf(buf + offset, 8, "upvalue"); return offset + 7;
+    case OBJ_WEAK_MAP:
+        snprintf(buf + offset, 11, "<weak map>");
+        return offset + 10;
+    case OBJ_WEAK_REF:
+        snprintf(buf + offset, 11, "<weak ref>");
+        return offset + 10;
     }
     UNREACHABLE();
     return -1;
@@ -5,6 +5,7 @@
 
 #include "chunk.h"
 #include "common.h"
+#include "dict.h"
 #include "table.h"
 #include "value.h"
 
@@ -21,6 +22,9 @@
 #define IS_ARRAY(value)        isObjType(value, OBJ_ARRAY)
 #define IS_MAP(value)          isObjType(value, OBJ_MAP)
 #define IS_RANGE(value)        isObjType(value, OBJ_RANGE)
+#define IS_UPVALUE(value)      isObjType(value, OBJ_UPVALUE)
+#define IS_WEAK_MAP(value)     isObjType(value, OBJ_WEAK_MAP)
+#define IS_WEAK_REF(value)     isObjType(value, OBJ_WEAK_REF)
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod *)AS_OBJ(value))
 #define AS_CLASS(value)        ((ObjClass *)AS_OBJ(value))
@@ -31,12 +35,16 @@
 #define AS_ARRAY(value)        ((ObjArray *)AS_OBJ(value))
 #define AS_MAP(value)          ((ObjMap *)AS_OBJ(value))
 #define AS_RANGE(value)        ((ObjRange *)AS_OBJ(value))
+#define AS_UPVALUE(value)      ((ObjUpvalue *)AS_OBJ(value))
 #define AS_STRING(value)       ((ObjString *)AS_OBJ(value))
 #define AS_CSTRING(value)      (((ObjString *)AS_OBJ(value))->chars)
 #define AS_ERROR(value)        ((ObjError *)AS_OBJ(value))
 #define AS_ERROR_MSG(value)    (((ObjError *)AS_OBJ(value))->msg->chars)
+#define AS_WEAK_MAP(value)     ((ObjWeakMap *)AS_OBJ(value))
+#define AS_WEAK_REF(value)     ((ObjWeakRef *)AS_OBJ(value))
 
-typedef enum {
+// packed into a byte to keep the object header small
+typedef enum __attribute__((packed)) {
     OBJ_BOUND_METHOD,
     OBJ_CLASS,
     OBJ_CLOSURE,
@@ -49,8 +57,13 @@ typedef enum {
     OBJ_ARRAY,
     OBJ_MAP,
     OBJ_RANGE,
+    OBJ_WEAK_MAP,
+    OBJ_WEAK_REF,
 } ObjType;
 
+// keep it in step with the last type
+#define OBJ_TYPE_CNT (OBJ_WEAK_REF + 1)
+
 static inline const char *ObjTypeString(ObjType t) {
     static const char *strings[] = {
         [OBJ_BOUND_METHOD] = "OBJ_BOUND_METHOD",
@@ -65,22 +78,48 @@ static inline const char *ObjTypeString(ObjType t) {
         [OBJ_ARRAY] = "OBJ_ARRAY",
         [OBJ_MAP] = "OBJ_MAP",
         [OBJ_RANGE] = "OBJ_RANGE",
+        [OBJ_WEAK_MAP] = "OBJ_WEAK_MAP",
+        [OBJ_WEAK_REF] = "OBJ_WEAK_REF",
     };
     return strings[t];
 }
 
+// three bytes, the fields of an object start in the rest of its first word
 struct Obj {
     ObjType type;
-    bool isMarked;
-    struct Obj *next;
+    // survived a collection, only full collections look at it again
+    bool isOld;
+    // already in the vm's remembered set
+    bool isRemembered;
 };
 
+// a function body that has only been scanned, it gets compiled on its first
+// call. the captured variables are resolved up front as the enclosing
+// compilers are gone by then
+typedef struct {
+    ObjString *source;       // keeps the source text alive
+    const char *start;       // the '(' of the parameter list
+    int line;                // line of `start`
+    int type;                // FunctionType of the body
+    bool inClass;            // can use `this`
+    bool hasSuperClass;      // can use `super`
+    ValueArray upvalueNames; // name of each upvalue, in order
+} LazyBody;
+
+// a function body compiled to C ahead of time, runs the top frame until it
+// returns and returns false on a runtime error
+typedef bool (*CompiledFn)(VM *vm);
+
 typedef struct {
     Obj obj;
     int arity;
     int upvalueCnt;
     Chunk chunk;
     ObjString *name;
+    LazyBody *lazy;        // NULL once the body has been compiled
+    const uint8_t *cached; // record in a mapped .loxc, NULL once loaded
+    CompiledFn compiled;   // NULL unless running a program built with --aot
+    struct ObjClosure *closure; // shared by all closures without upvalues
 } ObjFn;
 
 typedef Value (*NativeFn)(VM *vm, int argc, Value *args);
@@ -94,13 +133,13 @@ struct ObjString {
     Obj obj;
     int length;
     uint32_t hash;
-    char *chars;
+    char chars[];
 };
 
 typedef struct {
     Obj obj;
-    ObjString *msg;
     bool recoverable;
+    ObjString *msg;
 } ObjError;
 
 typedef struct ObjUpvalue {
@@ -110,11 +149,13 @@ typedef struct ObjUpvalue {
     struct ObjUpvalue *next;
 } ObjUpvalue;
 
-typedef struct {
+// captures that are never reassigned are copied straight into `upvalues`,
+// only mutable captures are boxed in an ObjUpvalue so they can be shared
+typedef struct ObjClosure {
     Obj obj;
-    ObjFn *fn;
-    ObjUpvalue **upvalues;
     int upvalueCnt;
+    ObjFn *fn;
+    Value upvalues[];
 } ObjClosure;
 
 typedef struct {
@@ -137,12 +178,14 @@ typedef struct {
 
 typedef struct {
     Obj obj;
+    // set once an object is stored in it, only clearing it unsets it
+    bool hasRefs;
     ValueArray items;
 } ObjArray;
 
 typedef struct {
     Obj obj;
-    Table items;
+    Dict items;
 } ObjMap;
 
 typedef struct {
@@ -152,7 +195,22 @@ typedef struct {
     double step;
 } ObjRange;
 
+// an entry stays as long as its key is reachable some other way, and keeps
+// its value alive until then. keys can be any object
+typedef struct {
+    Obj obj;
+    Table items;
+} ObjWeakMap;
+
+// an object that does not keep `target` alive, it is nil once collected
+typedef struct {
+    Obj obj;
+    Value target;
+} ObjWeakRef;
+
 ObjRange *newRange(VM *vm, double start, double stop, double step);
+ObjWeakMap *newWeakMap(VM *vm);
+ObjWeakRef *newWeakRef(VM *vm, Value target);
 ObjArray *newArray(VM *vm);
 ObjMap *newMap(VM *vm);
 ObjBoundMethod *newBoundMethod(VM *vm, Value reciever, ObjClosure *method);
@@ -164,6 +222,9 @@ ObjNative *newNative(VM *vm, NativeFn function);
 ObjUpvalue *newUpvalue(VM *vm, Value *slot);
 ObjError *newError(VM *vm, bool recoverable, const char *fmt, ...);
 
+// the hash strings are interned and looked up by
+uint32_t hashString(const char *key, int length);
+
 // used for dynamically allocated items
 ObjString *takeString(VM *vm, char *chars, int length);
 
@@ -180,25 +241,10 @@ int objectStringLength(Value value);
 int objectToStringX(Value value, char *buf, int offset);
 ObjString *objectToString(VM *vm, Value value);
 
-static inline void appendToArray(VM *vm, ObjArray *arr, Value value) {
-    writeValueArray(vm, &arr->items, value);
-}
-
-static inline void storeToArray(ObjArray *arr, int index, Value value) {
-    arr->items.values[index] = value;
-}
-
 static inline Value indexFromArray(ObjArray *arr, int index) {
     return arr->items.values[index];
 }
 
-static inline void deleteFromArray(ObjArray *arr, int index) {
-    for (int i = index; i < arr->items.cnt - 1; i++) {
-        arr->items.values[i] = arr->items.values[i + 1];
-    }
-    arr->items.values[arr->items.cnt--] = NIL_VAL;
-}
-
 static inline bool isObjType(Value value, ObjType type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
@@ -0,0 +1,55 @@
+#ifndef INCLUDE_CLOX_RUNTIME_H_
+#define INCLUDE_CLOX_RUNTIME_H_
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+// the parts of the interpreter that code compiled ahead of time by aot.c
+// calls into. anything that can fail reports its own runtime error, so the
+// caller only has to set the frame's ip first for the right line number
+
+void runtimeError(VM *vm, const char *format, ...);
+void undefinedGlobal(VM *vm, int index);
+bool callValue(VM *vm, Value callee, int argCnt);
+bool invoke(VM *vm, Value name, int argCnt);
+bool invokeFromClass(VM *vm, ObjClass *klass, Value name, int argc);
+bool bindMethod(VM *vm, ObjClass *klass, Value name);
+ObjUpvalue *captureUpvalue(VM *vm, Value *local);
+void closeUpvalues(VM *vm, Value *last);
+void concatenate(VM *vm);
+bool getIndex(VM *vm);
+bool setIndex(VM *vm);
+bool getProperty(VM *vm, Value name);
+bool setProperty(VM *vm, Value name);
+void defineMethod(VM *vm, Value name);
+bool inherit(VM *vm);
+void buildArray(VM *vm, int cnt);
+bool buildMap(VM *vm, int cnt);
+
+// runs a script whose functions all have compiled code
+InterpretResult runCompiled(VM *vm, ObjFn *script);
+
+static inline bool isFalsey(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static inline void printStatement(Value value) {
+#ifdef LOX_DEBUG
+    printf("\033[1;33m");
+#endif /* ifdef LOX_DEBUG */
+    printValue(value);
+#ifdef LOX_DEBUG
+    printf("\033[0m");
+#endif /* ifdef LOX_DEBUG */
+    printf("\n");
+}
+
+// runs the frame a call just pushed, natives have already finished by now
+static inline bool runCallee(VM *vm, int frameCount) {
+    if (vm->frameCount == frameCount) return true;
+    return vm->frames[vm->frameCount - 1].closure->fn->compiled(vm);
+}
+
+#endif // INCLUDE_CLOX_RUNTIME_H_
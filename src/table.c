@@ -1,108 +1,275 @@
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <string.h>
+
 #include "table.h"
 #include "memory.h"
 #include "object.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75
+// the most slots, counting deleted ones, that are in use before the table
+// grows. there is always an empty one, so a probe always ends
+#define TABLE_MAX_LOAD 0.875
+#define TABLE_MIN_CAP  8
+// an insert that probes more groups than this means the keys were picked to
+// collide, the table is then rebuilt with a salt of its own
+#define TABLE_MAX_PROBE 8
+
+// control bytes. a full slot holds the low 7 bits of its key's hash, the
+// high bit is only set in free ones
+#define CTRL_EMPTY   ((uint8_t)0x80)
+#define CTRL_DELETED ((uint8_t)0xfe)
 
 void initTable(Table *table) { *table = (Table){0}; }
 
+// the end of the buffer of a table with slots
+typedef struct {
+    // the slots deleted keys left behind
+    int tombs;
+    // 0 until an insert had to probe too far, then keys are placed by their
+    // hash mixed with it
+    uint32_t salt;
+} TableTail;
+
+static inline size_t tailOffset(int cap) {
+    return (sizeof(Entry) * cap + cap + TABLE_GROUP + 3) & ~(size_t)3;
+}
+
+static inline size_t tableBytes(int cap) {
+    return cap == 0 ? 0 : tailOffset(cap) + sizeof(TableTail);
+}
+
+static inline uint8_t *ctrlOf(Entry *entries, int cap) {
+    return (uint8_t *)(entries + cap);
+}
+
+static inline TableTail *tailOf(Table *table) {
+    return (TableTail *)((char *)table->entries + tailOffset(table->cap));
+}
+
+static inline uint32_t saltOf(Table *table) {
+    return table->cap == 0 ? 0 : tailOf(table)->salt;
+}
+
 void freeTable(VM *vm, Table *table) {
-    FREE_ARRAY(Entry, table->entries, table->cap);
+    reallocateBuffer(vm, table->entries, tableBytes(table->cap), 0);
     initTable(table);
 }
 
-static Entry *findEntry(Entry *entries, int cap, Value key) {
-    uint32_t idx = hashValue(key) & (cap - 1);
-    Entry *tombstone = NULL;
+// a bit for each of the 16 control bytes from `group` on that is `byte`
+static inline uint32_t matchByte(const uint8_t *group, uint8_t byte) {
+#ifdef __SSE2__
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+    __m128i match = _mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)byte));
+    return (uint32_t)_mm_movemask_epi8(match);
+#else
+    uint32_t bits = 0;
+    for (int i = 0; i < TABLE_GROUP; i++) {
+        if (group[i] == byte) bits |= (uint32_t)1 << i;
+    }
+    return bits;
+#endif
+}
+
+// the same for the bytes of free slots, empty or deleted
+static inline uint32_t matchFree(const uint8_t *group) {
+#ifdef __SSE2__
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+    return (uint32_t)_mm_movemask_epi8(ctrl);
+#else
+    uint32_t bits = 0;
+    for (int i = 0; i < TABLE_GROUP; i++) {
+        if (group[i] & 0x80) bits |= (uint32_t)1 << i;
+    }
+    return bits;
+#endif
+}
+
+// the copies past the end stand for the slots a group read from near the end
+// wraps around to, which for tables smaller than a group is all of them
+static inline void setCtrl(uint8_t *ctrl, int cap, int slot, uint8_t byte) {
+    ctrl[slot] = byte;
+    for (int i = slot; i < TABLE_GROUP; i += cap) {
+        ctrl[cap + i] = byte;
+    }
+}
+
+// a different salt for every table that needs one, derived from the hash
+// seed so that CLOX_HASH_SEED repeats them too
+uint32_t newSalt(void) {
+    static uint64_t state = 0;
+    state += 0x9e3779b97f4a7c15ull;
+    uint64_t z = state ^ hashSeed;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    z ^= z >> 31;
+    return (uint32_t)z | 1;
+}
+
+// groups are probed a growing distance apart, which visits each of them
+// once as the number of slots is a power of two
+typedef struct {
+    size_t mask;
+    size_t pos;
+    size_t step;
+} Probe;
+
+static inline Probe startProbe(uint32_t hash, int cap) {
+    size_t mask = (size_t)cap - 1;
+    return (Probe){mask, (hash >> 7) & mask, 0};
+}
+
+static inline void nextGroup(Probe *probe) {
+    probe->step += TABLE_GROUP;
+    probe->pos = (probe->pos + probe->step) & probe->mask;
+}
 
+// the slot of `key`, or -1
+static int findSlot(Table *table, Value key, uint32_t hash) {
+    uint8_t *ctrl = ctrlOf(table->entries, table->cap);
+    uint8_t low = hash & 0x7f;
+    Probe probe = startProbe(hash, table->cap);
     for (;;) {
-        Entry *entry = &entries[idx];
-        if (IS_EMPTY(entry->key)) {
-            if (IS_NIL(entry->value)) {
-                // Empty entry.
-                return tombstone != NULL ? tombstone : entry;
-            } else {
-                // We found a tombstone.
-                if (tombstone == NULL) tombstone = entry;
-            }
-        } else if (valuesEqual(key, entry->key)) {
-            // We found the key.
-            return entry;
+        uint8_t *group = ctrl + probe.pos;
+        uint32_t match = matchByte(group, low);
+        while (match != 0) {
+            size_t slot = (probe.pos + __builtin_ctz(match)) & probe.mask;
+            if (valuesEqual(table->entries[slot].key, key)) return (int)slot;
+            match &= match - 1;
         }
+        if (matchByte(group, CTRL_EMPTY) != 0) return -1;
+        nextGroup(&probe);
+    }
+}
 
-        idx = (idx + 1) & (cap - 1);
+// the first free slot on the way to where a key with `hash` would be, and
+// how many groups it took to get there
+static int findFree(uint8_t *ctrl, int cap, uint32_t hash, int *groups) {
+    Probe probe = startProbe(hash, cap);
+    for (*groups = 1;; (*groups)++) {
+        uint32_t match = matchFree(ctrl + probe.pos);
+        if (match != 0) {
+            return (int)((probe.pos + __builtin_ctz(match)) & probe.mask);
+        }
+        nextGroup(&probe);
     }
 }
 
+static inline uint32_t hashOf(Table *table, Value key) {
+    return homeOf(hashValue(key), saltOf(table));
+}
+
 bool tableGet(Table *table, Value key, Value *value) {
     if (table->cnt == 0) return false;
 
-    Entry *entry = findEntry(table->entries, table->cap, key);
-    if (IS_EMPTY(entry->key)) return false;
+    int slot = findSlot(table, key, hashOf(table, key));
+    if (slot < 0) return false;
 
-    *value = entry->value;
+    *value = table->entries[slot].value;
     return true;
 }
 
 bool tableContains(Table *table, Value key) {
     if (table->cnt == 0) return false;
-
-    Entry *entry = findEntry(table->entries, table->cap, key);
-    return !IS_EMPTY(entry->key);
+    return findSlot(table, key, hashOf(table, key)) >= 0;
 }
 
-static void adjustCap(VM *vm, Table *table, int cap) {
-    Entry *entries = ALLOCATE(Entry, cap);
+// moves the keys to new arrays of `cap` slots placed with `salt`, which also
+// drops the deleted ones
+static void adjustCap(VM *vm, Table *table, int cap, uint32_t salt) {
+    Entry *entries = (Entry *)reallocateBuffer(vm, NULL, 0, tableBytes(cap));
     for (int i = 0; i < cap; i++) {
         entries[i] = (Entry){EMPTY_VAL, NIL_VAL};
     }
+    uint8_t *ctrl = ctrlOf(entries, cap);
+    memset(ctrl, CTRL_EMPTY, cap + TABLE_GROUP);
 
-    table->cnt = 0;
     for (int i = 0; i < table->cap; i++) {
         Entry *entry = &table->entries[i];
         if (IS_EMPTY(entry->key)) continue;
 
-        Entry *dest = findEntry(entries, cap, entry->key);
-        *dest = (Entry){entry->key, entry->value};
-        table->cnt++;
+        uint32_t hash = homeOf(hashValue(entry->key), salt);
+        int groups;
+        int slot = findFree(ctrl, cap, hash, &groups);
+        setCtrl(ctrl, cap, slot, hash & 0x7f);
+        entries[slot] = *entry;
     }
 
-    FREE_ARRAY(Entry, table->entries, table->cap);
-    table->entries = entries;
-    table->cap = cap;
+    *(TableTail *)((char *)entries + tailOffset(cap)) = (TableTail){0, salt};
+
+    // a marking thread reads the capacity first, it must not see the new one
+    // with the old entries. the entries are published filled in
+    reallocateBuffer(vm, table->entries, tableBytes(table->cap), 0);
+    __atomic_store_n(&table->entries, entries, __ATOMIC_RELEASE);
+    __atomic_store_n(&table->cap, cap, __ATOMIC_RELEASE);
 }
 
 bool tableSet(VM *vm, Table *table, Value key, Value value) {
-    if (table->cnt + 1 > table->cap * TABLE_MAX_LOAD) {
-        int cap = GROW_CAP(table->cap);
-        adjustCap(vm, table, cap);
+    if (table->cnt > 0) {
+        int slot = findSlot(table, key, hashOf(table, key));
+        if (slot >= 0) {
+            storeValue(&table->entries[slot].value, value);
+            return false;
+        }
     }
 
-    Entry *entry = findEntry(table->entries, table->cap, key);
-    bool isNewKey = IS_EMPTY(entry->key);
-    if (isNewKey && IS_NIL(entry->value)) table->cnt++;
-    *entry = (Entry){key, value};
-    return isNewKey;
+    int tombs = table->cap == 0 ? 0 : tailOf(table)->tombs;
+    if (table->cnt + tombs + 1 > table->cap * TABLE_MAX_LOAD) {
+        // mostly deleted slots only need clearing out
+        int cap = table->cnt + 1 > table->cap * TABLE_MAX_LOAD / 2
+                      ? GROW_CAP(table->cap)
+                      : table->cap;
+        adjustCap(vm, table, cap < TABLE_MIN_CAP ? TABLE_MIN_CAP : cap,
+                  saltOf(table));
+    }
+
+    uint32_t hash = hashOf(table, key);
+    uint8_t *ctrl = ctrlOf(table->entries, table->cap);
+    int groups;
+    int slot = findFree(ctrl, table->cap, hash, &groups);
+    if (ctrl[slot] == CTRL_DELETED) tailOf(table)->tombs--;
+    storeValue(&table->entries[slot].key, key);
+    storeValue(&table->entries[slot].value, value);
+    setCtrl(ctrl, table->cap, slot, hash & 0x7f);
+    table->cnt++;
+
+    if (groups > TABLE_MAX_PROBE && saltOf(table) == 0) {
+        adjustCap(vm, table, table->cap, newSalt());
+    }
+    return true;
+}
+
+// frees the slot of a key that was just deleted
+static void clearSlot(Table *table, int slot) {
+    storeValue(&table->entries[slot].key, EMPTY_VAL);
+    storeValue(&table->entries[slot].value, NIL_VAL);
+    setCtrl(ctrlOf(table->entries, table->cap), table->cap, slot,
+            CTRL_DELETED);
+    table->cnt--;
+    tailOf(table)->tombs++;
 }
 
 bool tableDelete(Table *table, Value key) {
     if (table->cnt == 0) return false;
 
-    // find entry
-    Entry *entry = findEntry(table->entries, table->cap, key);
-    if (IS_EMPTY(entry->key)) return false;
+    int slot = findSlot(table, key, hashOf(table, key));
+    if (slot < 0) return false;
 
-    // place tombstone in the entry
-    *entry = (Entry){EMPTY_VAL, BOOL_VAL(true)};
+    clearSlot(table, slot);
     return true;
 }
 
 void tableClear(Table *table) {
-    for (int i = 0; i < table->cnt; i++) {
-        table->entries[i] = (Entry){EMPTY_VAL, NIL_VAL};
+    if (table->cap == 0) return;
+    for (int i = 0; i < table->cap; i++) {
+        storeValue(&table->entries[i].key, EMPTY_VAL);
+        storeValue(&table->entries[i].value, NIL_VAL);
     }
+    memset(ctrlOf(table->entries, table->cap), CTRL_EMPTY,
+           table->cap + TABLE_GROUP);
     table->cnt = 0;
+    tailOf(table)->tombs = 0;
 }
 
 void tableAddAll(VM *vm, Table *from, Table *to) {
@@ -116,38 +283,50 @@ ObjString *tableFindString(Table *table, const char *chars, int len,
                            uint32_t hash) {
     if (table->cnt == 0) return NULL;
 
-    uint32_t idx = hash & (table->cap - 1);
+    uint32_t home = homeOf(hash, saltOf(table));
+    uint8_t *ctrl = ctrlOf(table->entries, table->cap);
+    Probe probe = startProbe(home, table->cap);
     for (;;) {
-        Entry *entry = &table->entries[idx];
-        if (IS_EMPTY(entry->key)) {
-            // stop if we find an empty non-tombstone entry
-            if (IS_NIL(entry->value)) return NULL;
-        } else if (IS_STRING(entry->key)) {
-            ObjString *string = AS_STRING(entry->key);
-            if (string->length == len && string->hash == hash &&
-                memcmp(string->chars, chars, len) == 0) {
-                // we found it
-                return string;
+        uint8_t *group = ctrl + probe.pos;
+        uint32_t match = matchByte(group, home & 0x7f);
+        while (match != 0) {
+            size_t slot = (probe.pos + __builtin_ctz(match)) & probe.mask;
+            Value key = table->entries[slot].key;
+            if (IS_STRING(key)) {
+                ObjString *string = AS_STRING(key);
+                if (string->length == len && string->hash == hash &&
+                    memcmp(string->chars, chars, len) == 0) {
+                    return string;
+                }
             }
+            match &= match - 1;
         }
-        idx = (idx + 1) & (table->cap - 1);
+        if (matchByte(group, CTRL_EMPTY) != 0) return NULL;
+        nextGroup(&probe);
     }
 }
 
-void tableRemoveWhite(Table *table) {
+void tableRemoveWhite(Table *table, bool youngOnly) {
     for (int i = 0; i < table->cap; i++) {
         Entry *entry = &table->entries[i];
-        if (IS_STRING(entry->key)) {
-            ObjString *string = AS_STRING(entry->key);
-            if (!string->obj.isMarked) tableDelete(table, entry->key);
+        if (IS_OBJ(entry->key)) {
+            Obj *key = AS_OBJ(entry->key);
+            if (youngOnly && key->isOld) continue;
+            if (!isMarked(key)) clearSlot(table, i);
         }
     }
 }
 
-void markTable(VM *vm, Table *table) {
-    for (int i = 0; i < table->cap; i++) {
-        Entry *entry = &table->entries[i];
-        markValue(vm, entry->key);
-        markValue(vm, entry->value);
+int markTable(VM *vm, Table *table) {
+    // the table can be growing or freed on another thread. entries are only
+    // ever swapped for bigger ones, or NULL, and old ones are kept around
+    int cap = __atomic_load_n(&table->cap, __ATOMIC_ACQUIRE);
+    Entry *entries = __atomic_load_n(&table->entries, __ATOMIC_ACQUIRE);
+    if (entries == NULL) return 0;
+
+    for (int i = 0; i < cap; i++) {
+        markValue(vm, loadValue(&entries[i].key));
+        markValue(vm, loadValue(&entries[i].value));
     }
+    return cap;
 }
@@ -4,11 +4,21 @@
 #include "common.h"
 #include "value.h"
 
+// the control bytes a probe looks at in one go
+#define TABLE_GROUP 16
+
 typedef struct {
     Value key;
     Value value;
 } Entry;
 
+// a swiss table. `entries` is followed by a control byte for each slot, and
+// copies of the first TABLE_GROUP of them so a group can be read from any
+// slot. probing compares 16 control bytes at a time, and only looks at the
+// entries whose byte holds the low 7 bits of the key's hash. free slots have
+// an empty key, so the entries can be walked without the control bytes. what
+// else a table needs is kept after the control bytes, so that it fits in the
+// 16 bytes instances and classes have room for
 typedef struct {
     int cnt;
     int cap;
@@ -17,6 +27,16 @@ typedef struct {
 
 typedef struct VM VM;
 
+// where probing for a key with `hash` starts
+static inline uint32_t homeOf(uint32_t hash, uint32_t salt) {
+    if (salt == 0) return hash;
+    // the high half of the product depends on every bit of the hash, so keys
+    // that only differ in high bits are spread out too
+    return (uint32_t)(((uint64_t)(hash ^ salt) * 0x9e3779b97f4a7c15ull) >> 32);
+}
+
+uint32_t newSalt(void);
+
 void initTable(Table *table);
 void freeTable(VM *vm, Table *table);
 bool tableGet(Table *table, Value key, Value *value);
@@ -28,7 +48,9 @@ void tableAddAll(VM *vm, Table *from, Table *to);
 ObjString *tableFindString(Table *table, const char *chars, int len,
                            uint32_t hash);
 
-void tableRemoveWhite(Table *table);
-void markTable(VM *vm, Table *table);
+// removes keys about to be freed. a minor collection leaves old ones
+void tableRemoveWhite(Table *table, bool youngOnly);
+// returns the number of slots it looked at
+int markTable(VM *vm, Table *table);
 
 #endif // INCLUDE_CLOX_TABLE_H_
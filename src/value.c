@@ -1,6 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "memory.h"
 #include "object.h"
@@ -9,7 +12,7 @@
 void initValueArray(ValueArray *array) { *array = (ValueArray){0}; }
 
 void freeValueArray(VM *vm, ValueArray *array) {
-    FREE_ARRAY(Value, array->values, array->cap);
+    FREE_BUFFER(Value, array->values, array->cap);
     initValueArray(array);
 }
 
@@ -17,9 +20,13 @@ void writeValueArray(VM *vm, ValueArray *array, Value value) {
     if (array->cap < array->cnt + 1) {
         size_t oldCap = array->cap;
         array->cap = GROW_CAP(oldCap);
-        array->values = GROW_ARRAY(Value, array->values, oldCap, array->cap);
+        Value *values = GROW_BUFFER(Value, array->values, oldCap, array->cap);
+        __atomic_store_n(&array->values, values, __ATOMIC_RELEASE);
     }
-    array->values[array->cnt++] = value;
+    storeValue(&array->values[array->cnt], value);
+    // a marking thread reads the count first, it must not see it before the
+    // new value and buffer
+    __atomic_store_n(&array->cnt, array->cnt + 1, __ATOMIC_RELEASE);
 }
 
 void printValue(Value value) {
@@ -63,6 +70,29 @@ bool valuesEqual(Value a, Value b) {
 #endif
 }
 
+uint64_t hashSeed;
+
+void seedHashes(void) {
+    static bool seeded = false;
+    if (seeded) return;
+    seeded = true;
+
+    const char *fixed = getenv("CLOX_HASH_SEED");
+    if (fixed != NULL) {
+        hashSeed = strtoull(fixed, NULL, 0);
+        return;
+    }
+    if (getrandom(&hashSeed, sizeof(hashSeed), GRND_NONBLOCK) ==
+        sizeof(hashSeed)) {
+        return;
+    }
+    // no entropy yet this early in boot, which is still better than none
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    hashSeed = ((uint64_t)now.tv_sec << 32) ^ (uint64_t)now.tv_nsec ^
+               ((uint64_t)getpid() << 16);
+}
+
 static inline uint32_t hashBits(uint64_t hash) {
     // From v8's ComputeLongHash() which in turn cites:
     // Thomas Wang, Integer Hash Functions.
@@ -78,9 +108,9 @@ static inline uint32_t hashBits(uint64_t hash) {
 
 static inline uint32_t hashNumber(double value) {
 #ifdef NAN_BOXING
-    return hashBits(valueToNum(value));
+    return hashBits(numToValue(value) ^ hashSeed);
 #else
-    return hashBits(*((uint64_t *)&value));
+    return hashBits(*((uint64_t *)&value) ^ hashSeed);
 #endif
 }
 
@@ -98,6 +128,7 @@ static uint32_t hashObject(Obj *object) {
         uint32_t klassHash = ((ObjInstance *)object)->klass->name->hash;
         return klassHash ^ hashBits((uint64_t)(uintptr_t)object);
     }
+    // the rest only hash by who they are, as weak map keys
     case OBJ_RANGE:
     case OBJ_BOUND_METHOD:
     case OBJ_ARRAY:
@@ -105,6 +136,8 @@ static uint32_t hashObject(Obj *object) {
     case OBJ_CLOSURE:
     case OBJ_NATIVE:
     case OBJ_UPVALUE:
+    case OBJ_WEAK_MAP:
+    case OBJ_WEAK_REF:     return hashBits((uint64_t)(uintptr_t)object);
     default:               UNREACHABLE(); return 0;
     }
 }
@@ -112,7 +145,7 @@ static uint32_t hashObject(Obj *object) {
 uint32_t hashValue(Value value) {
 #ifdef NAN_BOXING
     if (IS_OBJ(value)) return hashObject(AS_OBJ(value));
-    return hashBits(value);
+    return hashBits(value ^ hashSeed);
 #else
     switch (value.type) {
     case VAL_BOOL:   return AS_BOOL(value) ? 3 : 5;
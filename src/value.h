@@ -100,6 +100,27 @@ typedef struct {
     Value *values;
 } ValueArray;
 
+// reads a slot the mutator may be storing to while the marking thread runs.
+// acquire pairs with storeValue, so an object found in the slot is seen
+// with the fields it was made with
+static inline Value loadValue(const Value *slot) {
+#ifdef NAN_BOXING
+    return __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+#else
+    return *slot;
+#endif // ifdef NAN_BOXING
+}
+
+// stores to a slot of an object the marking thread may be reading. both are
+// plain moves on x86
+static inline void storeValue(Value *slot, Value value) {
+#ifdef NAN_BOXING
+    __atomic_store_n(slot, value, __ATOMIC_RELEASE);
+#else
+    *slot = value;
+#endif // ifdef NAN_BOXING
+}
+
 typedef struct VM VM;
 
 bool valuesEqual(Value a, Value b);
@@ -108,6 +129,12 @@ void writeValueArray(VM *vm, ValueArray *array, Value value);
 void freeValueArray(VM *vm, ValueArray *array);
 void printValue(Value value);
 uint32_t hashValue(Value value);
+// mixed into the hashes of strings and numbers, so which keys collide can't
+// be known outside the process
+extern uint64_t hashSeed;
+// picks the seed the first time it is called. CLOX_HASH_SEED in the
+// environment fixes it, for runs that have to be repeatable
+void seedHashes(void);
 const char *typeofValue(Value value);
 
 int valueStringLength(Value value);
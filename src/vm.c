@@ -1,12 +1,15 @@
 #include <stdarg.h>
 #include <stdlib.h>
+#include <unistd.h>
 
+#include "cache.h"
 #include "chunk.h"
 #include "common.h"
 #include "compiler.h"
 #include "memory.h"
 #include "natives.h"
 #include "object.h"
+#include "runtime.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
@@ -22,7 +25,7 @@ static inline void resetStack(VM *vm) {
     vm->tempCnt = 0;
 }
 
-static void runtimeError(VM *vm, const char *format, ...) {
+void runtimeError(VM *vm, const char *format, ...) {
     va_list args;
     va_start(args, format);
     vfprintf(stderr, format, args);
@@ -51,11 +54,22 @@ void initVM(VM *vm) {
     resetStack(vm);
 
     // set up VM state that should not be a zero value
-    vm->nextGC = 1024 * 1024; // 1mib
-
+    vm->nextGC = NURSERY_SIZE;
+    vm->nextMajorGC = GC_MIN_HEAP;
+    vm->pacer.cpuTarget = GC_CPU_TARGET;
+    vm->gcStats.vmStart = gcClock();
+    // marking on other threads only pays off with cores to spare
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    vm->gcConcurrent = cores > 1;
+    vm->gcWorkers = (int)cores - 1;
+    if (vm->gcWorkers < 1) vm->gcWorkers = 1;
+    if (vm->gcWorkers > GC_WORKERS_MAX) vm->gcWorkers = GC_WORKERS_MAX;
+    vm->gcStepWork = GC_STEP_WORK;
+
+    seedHashes();
     initTable(&vm->globalNames);
     initValueArray(&vm->globalValues);
-    initTable(&vm->strings);
+    initInternSet(&vm->strings);
 
     vm->initString = CONST_STRING("init");
 
@@ -65,9 +79,10 @@ void initVM(VM *vm) {
 void freeVM(VM *vm) {
     freeTable(vm, &vm->globalNames);
     freeValueArray(vm, &vm->globalValues);
-    freeTable(vm, &vm->strings);
+    freeInternSet(&vm->strings);
     vm->initString = NULL;
     freeObjects(vm);
+    freeCaches(vm);
 }
 
 static const char *findGlobalNameFromIndex(const VM *vm, int index) {
@@ -80,7 +95,28 @@ static const char *findGlobalNameFromIndex(const VM *vm, int index) {
     return NULL;
 }
 
+void undefinedGlobal(VM *vm, int index) {
+    runtimeError(vm, "Undefined variable '%s'",
+                 findGlobalNameFromIndex(vm, index));
+}
+
+// lazy and cached functions only get their body when they are first called
+static bool loadBody(VM *vm, ObjFn *fn) {
+    if (fn->cached != NULL) {
+        loadCachedBody(vm, fn);
+        return true;
+    }
+    if (compileLazy(vm, fn)) return true;
+
+    runtimeError(vm, "Could not compile '%s'", fn->name->chars);
+    return false;
+}
+
 static bool call(VM *vm, ObjClosure *closure, int argc) {
+    if (closure->fn->chunk.code == NULL && !loadBody(vm, closure->fn)) {
+        return false;
+    }
+
     if (argc != closure->fn->arity) {
         runtimeError(vm, "Expected %d arguments but got %d", closure->fn->arity,
                      argc);
@@ -100,7 +136,7 @@ static bool call(VM *vm, ObjClosure *closure, int argc) {
     return true;
 }
 
-static bool callValue(VM *vm, Value callee, int argCnt) {
+bool callValue(VM *vm, Value callee, int argCnt) {
     if (IS_OBJ(callee)) {
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wswitch-enum"
@@ -152,8 +188,7 @@ static bool callValue(VM *vm, Value callee, int argCnt) {
     return false;
 }
 
-static inline bool invokeFromClass(VM *vm, ObjClass *klass, Value name,
-                                   int argc) {
+bool invokeFromClass(VM *vm, ObjClass *klass, Value name, int argc) {
     Value method = EMPTY_VAL;
     if (!tableGet(&klass->methods, name, &method)) {
         runtimeError(vm, "Undefined property '%s'", AS_CSTRING(name));
@@ -162,7 +197,7 @@ static inline bool invokeFromClass(VM *vm, ObjClass *klass, Value name,
     return callValue(vm, method, argc);
 }
 
-static bool invoke(VM *vm, Value name, int argCnt) {
+bool invoke(VM *vm, Value name, int argCnt) {
     Value receiver = peek(vm, argCnt);
 
     if (!IS_INSTANCE(receiver)) {
@@ -181,7 +216,7 @@ static bool invoke(VM *vm, Value name, int argCnt) {
     return invokeFromClass(vm, instance->klass, name, argCnt);
 }
 
-static bool bindMethod(VM *vm, ObjClass *klass, Value name) {
+bool bindMethod(VM *vm, ObjClass *klass, Value name) {
     Value method = EMPTY_VAL;
     if (!tableGet(&klass->methods, name, &method)) {
         runtimeError(vm, "Undefined property '%s'", AS_CSTRING(name));
@@ -194,7 +229,7 @@ static bool bindMethod(VM *vm, ObjClass *klass, Value name) {
     return true;
 }
 
-static ObjUpvalue *captureUpvalue(VM *vm, Value *local) {
+ObjUpvalue *captureUpvalue(VM *vm, Value *local) {
     ObjUpvalue *prv = NULL;
     ObjUpvalue *upvalue = vm->openUpvalues;
     while (upvalue != NULL && upvalue->location > local) {
@@ -216,27 +251,25 @@ static ObjUpvalue *captureUpvalue(VM *vm, Value *local) {
     return createdUpvalue;
 }
 
-static void closeUpvalues(VM *vm, Value *last) {
+void closeUpvalues(VM *vm, Value *last) {
     while (vm->openUpvalues != NULL && vm->openUpvalues->location >= last) {
         ObjUpvalue *upvalue = vm->openUpvalues;
-        upvalue->closed = *upvalue->location;
+        storeValue(&upvalue->closed, *upvalue->location);
         upvalue->location = &upvalue->closed;
+        writeBarrier(vm, (Obj *)upvalue);
         vm->openUpvalues = upvalue->next;
     }
 }
 
-static inline void defineMethod(VM *vm, Value name) {
+void defineMethod(VM *vm, Value name) {
     Value method = peek(vm, 0);
     ObjClass *klass = AS_CLASS(peek(vm, 1));
     tableSet(vm, &klass->methods, name, method);
+    writeBarrier(vm, (Obj *)klass);
     pop(vm);
 }
 
-static inline bool isFalsey(Value value) {
-    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
-}
-
-static inline void concatenate(VM *vm) {
+void concatenate(VM *vm) {
     ObjString *b = AS_STRING(peek(vm, 0));
     ObjString *a = AS_STRING(peek(vm, 1));
 
@@ -336,7 +369,7 @@ static inline bool doIndexedGet(VM *vm) {
 
         ObjMap *map = AS_MAP(pop(vm));
         Value result = NIL_VAL;
-        tableGet(&map->items, key, &result);
+        dictGet(&map->items, key, &result);
         push(vm, result);
         return true;
     }
@@ -365,6 +398,21 @@ static inline bool doIndexedGet(VM *vm) {
         push(vm, NUMBER_VAL(index * range->step + range->start));
         return true;
     }
+    case OBJ_WEAK_MAP: {
+        Value key = peek(vm, 0);
+        if (!IS_OBJ(key)) {
+            runtimeError(vm, "Weak map keys must be objects, got %s",
+                         typeofValue(key));
+            return false;
+        }
+
+        ObjWeakMap *map = AS_WEAK_MAP(peek(vm, 1));
+        Value result = NIL_VAL;
+        tableGet(&map->items, key, &result);
+        vm->sp -= 2; // pop key and map
+        push(vm, result);
+        return true;
+    }
     default: UNREACHABLE(); return false;
     }
 #pragma GCC diagnostic pop
@@ -397,7 +445,7 @@ static inline bool doIndexedSet(VM *vm) {
             return false;
         }
 
-        storeToArray(arr, index, value);
+        storeToArray(vm, arr, index, value);
         push(vm, value);
         return true;
     }
@@ -410,7 +458,24 @@ static inline bool doIndexedSet(VM *vm) {
         }
 
         ObjMap *map = AS_MAP(peek(vm, 2));
+        dictSet(vm, &map->items, key, value);
+        writeBarrier(vm, (Obj *)map);
+        vm->sp -= 3;
+        push(vm, value);
+        return true;
+    }
+    case OBJ_WEAK_MAP: {
+        Value value = peek(vm, 0);
+        Value key = peek(vm, 1);
+        if (!IS_OBJ(key)) {
+            runtimeError(vm, "Weak map keys must be objects, got %s",
+                         typeofValue(key));
+            return false;
+        }
+
+        ObjWeakMap *map = AS_WEAK_MAP(peek(vm, 2));
         tableSet(vm, &map->items, key, value);
+        writeBarrier(vm, (Obj *)map);
         vm->sp -= 3;
         push(vm, value);
         return true;
@@ -420,6 +485,106 @@ static inline bool doIndexedSet(VM *vm) {
 #pragma GCC diagnostic pop
 }
 
+bool getIndex(VM *vm) {
+    if (!isIndexable(peek(vm, 1)) && !IS_WEAK_MAP(peek(vm, 1))) {
+        runtimeError(vm, "%s is not an indexable type",
+                     typeofValue(peek(vm, 1)));
+        return false;
+    }
+    return doIndexedGet(vm);
+}
+
+bool setIndex(VM *vm) {
+    if (!isIndexable(peek(vm, 2)) && !IS_WEAK_MAP(peek(vm, 2))) {
+        runtimeError(vm, "%s is not an indexable type",
+                     typeofValue(peek(vm, 2)));
+        return false;
+    }
+    return doIndexedSet(vm);
+}
+
+bool getProperty(VM *vm, Value name) {
+    if (!IS_INSTANCE(peek(vm, 0))) {
+        runtimeError(vm, "Only instances have properties");
+        return false;
+    }
+
+    ObjInstance *instance = AS_INSTANCE(peek(vm, 0));
+    Value value = EMPTY_VAL;
+    if (tableGet(&instance->fields, name, &value)) {
+        (void)pop(vm); // instance
+        push(vm, value);
+        return true;
+    }
+
+    return bindMethod(vm, instance->klass, name);
+}
+
+bool setProperty(VM *vm, Value name) {
+    if (!IS_INSTANCE(peek(vm, 1))) {
+        runtimeError(vm, "Only instances have fields");
+        return false;
+    }
+
+    ObjInstance *instance = AS_INSTANCE(peek(vm, 1));
+    tableSet(vm, &instance->fields, name, peek(vm, 0));
+    writeBarrier(vm, (Obj *)instance);
+    Value value = pop(vm);
+    (void)pop(vm); // instance
+    push(vm, value);
+    return true;
+}
+
+bool inherit(VM *vm) {
+    Value superclass = peek(vm, 1);
+    if (!IS_CLASS(superclass)) {
+        runtimeError(vm, "Superclass must be a class");
+        return false;
+    }
+
+    ObjClass *subclass = AS_CLASS(peek(vm, 0));
+    tableAddAll(vm, &AS_CLASS(superclass)->methods, &subclass->methods);
+    writeBarrier(vm, (Obj *)subclass);
+    (void)pop(vm); // subclass
+    return true;
+}
+
+void buildArray(VM *vm, int cnt) {
+    ObjArray *arr = newArray(vm);
+    pushRoot(vm, OBJ_VAL(arr));
+    for (int i = cnt - 1; i >= 0; i--) {
+        appendToArray(vm, arr, peek(vm, i));
+    }
+    popRoot(vm);
+
+    vm->sp -= cnt;
+    push(vm, OBJ_VAL(arr));
+}
+
+// `cnt` is the number of key value pairs
+bool buildMap(VM *vm, int cnt) {
+    cnt *= 2;
+
+    ObjMap *map = newMap(vm);
+    pushRoot(vm, OBJ_VAL(map));
+    for (int i = cnt - 1; i >= 0; i -= 2) {
+        Value key = peek(vm, i);
+        if (!isHashable(key)) {
+            runtimeError(vm, "%s is an unhashable type", typeofValue(key));
+            return false;
+        }
+        Value val = peek(vm, i - 1);
+        dictSet(vm, &map->items, key, val);
+    }
+    // everything stored is still on the stack until here
+    writeBarrier(vm, (Obj *)map);
+    popRoot(vm);
+
+    vm->sp -= cnt;
+    push(vm, OBJ_VAL(map));
+    return true;
+}
+
 static InterpretResult run(VM *vm) {
     CallFrame *frame = &vm->frames[vm->frameCount - 1];
 
@@ -470,20 +635,10 @@ static InterpretResult run(VM *vm) {
         case OP_FALSE:     PUSH(BOOL_VAL(false)); break;
         case OP_POP:       (void)POP(); break;
         case OP_GET_INDEX: {
-            if (!isIndexable(PEEK(1))) {
-                runtimeError(vm, "%s is not an indexable type",
-                             typeofValue(PEEK(1)));
-                return INTERPRET_RUNTIME_ERR;
-            }
-            if (!doIndexedGet(vm)) return INTERPRET_RUNTIME_ERR;
+            if (!getIndex(vm)) return INTERPRET_RUNTIME_ERR;
         } break;
         case OP_SET_INDEX: {
-            if (!isIndexable(PEEK(2))) {
-                runtimeError(vm, "%s is not an indexable type",
-                             typeofValue(PEEK(2)));
-                return INTERPRET_RUNTIME_ERR;
-            }
-            if (!doIndexedSet(vm)) return INTERPRET_RUNTIME_ERR;
+            if (!setIndex(vm)) return INTERPRET_RUNTIME_ERR;
         } break;
         case OP_GET_LOCAL:  PUSH(frame->slots[READ_BYTE()]); break;
         case OP_SET_LOCAL:  frame->slots[READ_BYTE()] = PEEK(0); break;
@@ -491,8 +646,7 @@ static InterpretResult run(VM *vm) {
             int index = READ_BYTE();
             Value value = vm->globalValues.values[index];
             if (IS_EMPTY(value)) {
-                const char *name = findGlobalNameFromIndex(vm, index);
-                runtimeError(vm, "Undefined variable '%s'", name);
+                undefinedGlobal(vm, index);
                 return INTERPRET_RUNTIME_ERR;
             }
             PUSH(value);
@@ -503,49 +657,27 @@ static InterpretResult run(VM *vm) {
         case OP_SET_GLOBAL: {
             int index = READ_BYTE();
             if (IS_EMPTY(vm->globalValues.values[index])) {
-                const char *name = findGlobalNameFromIndex(vm, index);
-                runtimeError(vm, "Undefined variable '%s'", name);
+                undefinedGlobal(vm, index);
                 return INTERPRET_RUNTIME_ERR;
             }
             vm->globalValues.values[index] = PEEK(0);
         } break;
         case OP_GET_UPVALUE: {
-            uint8_t slot = READ_BYTE();
-            PUSH(*frame->closure->upvalues[slot]->location);
+            Value value = frame->closure->upvalues[READ_BYTE()];
+            if (IS_UPVALUE(value)) value = *AS_UPVALUE(value)->location;
+            PUSH(value);
         } break;
         case OP_SET_UPVALUE: {
-            uint8_t slot = READ_BYTE();
-            *frame->closure->upvalues[slot]->location = PEEK(0);
+            // only mutable captures are ever assigned to
+            Value upvalue = frame->closure->upvalues[READ_BYTE()];
+            storeValue(AS_UPVALUE(upvalue)->location, PEEK(0));
+            writeBarrier(vm, AS_OBJ(upvalue));
         } break;
         case OP_GET_PROPERTY: {
-            if (!IS_INSTANCE(PEEK(0))) {
-                runtimeError(vm, "Only instances have properties");
-                return INTERPRET_RUNTIME_ERR;
-            }
-
-            ObjInstance *instance = AS_INSTANCE(PEEK(0));
-            Value name = READ_CONST();
-            Value value = EMPTY_VAL;
-            if (tableGet(&instance->fields, name, &value)) {
-                (void)POP(); // instance
-                PUSH(value);
-                break;
-            }
-
-            if (!bindMethod(vm, instance->klass, name)) {
-                return INTERPRET_RUNTIME_ERR;
-            }
+            if (!getProperty(vm, READ_CONST())) return INTERPRET_RUNTIME_ERR;
         } break;
         case OP_SET_PROPERTY: {
-            if (!IS_INSTANCE(PEEK(1))) {
-                runtimeError(vm, "Only instances have fields");
-                return INTERPRET_RUNTIME_ERR;
-            }
-            ObjInstance *instance = AS_INSTANCE(PEEK(1));
-            tableSet(vm, &instance->fields, READ_CONST(), PEEK(0));
-            Value value = POP();
-            (void)POP(); // instance
-            PUSH(value);
+            if (!setProperty(vm, READ_CONST())) return INTERPRET_RUNTIME_ERR;
         } break;
         case OP_GET_SUPER: {
             Value name = READ_CONST();
@@ -599,16 +731,7 @@ static InterpretResult run(VM *vm) {
             }
             vm->sp[-1] = NUMBER_VAL(-AS_NUMBER(vm->sp[-1]));
         } break;
-        case OP_PRINT: {
-#ifdef LOX_DEBUG
-            printf("\033[1;33m");
-#endif /* ifdef LOX_DEBUG */
-            printValue(POP());
-#ifdef LOX_DEBUG
-            printf("\033[0m");
-#endif /* ifdef LOX_DEBUG */
-            printf("\n");
-        } break;
+        case OP_PRINT:  printStatement(POP()); break;
         case OP_JUMP: {
             uint16_t offset = READ_SHORT();
             frame->ip += offset;
@@ -647,15 +770,21 @@ static InterpretResult run(VM *vm) {
             ObjClosure *closure = newClosure(vm, function);
             PUSH(OBJ_VAL(closure));
             for (int i = 0; i < closure->upvalueCnt; i++) {
-                uint8_t isLocal = READ_BYTE();
+                uint8_t flags = READ_BYTE();
                 uint8_t index = READ_BYTE();
-                if (isLocal) {
-                    closure->upvalues[i] =
+                if (flags & UPVALUE_MUTABLE) {
+                    ObjUpvalue *upvalue =
                         captureUpvalue(vm, frame->slots + index);
+                    storeValue(&closure->upvalues[i], OBJ_VAL(upvalue));
+                } else if (flags & UPVALUE_LOCAL) {
+                    storeValue(&closure->upvalues[i], frame->slots[index]);
                 } else {
-                    closure->upvalues[i] = frame->closure->upvalues[index];
+                    storeValue(&closure->upvalues[i],
+                               frame->closure->upvalues[index]);
                 }
             }
+            // capturing can collect, which might have promoted the closure
+            writeBarrier(vm, (Obj *)closure);
         } break;
         case OP_CLOSE_UPVALUE: {
             closeUpvalues(vm, vm->sp - 1);
@@ -674,50 +803,13 @@ static InterpretResult run(VM *vm) {
             PUSH(result);
             frame = &vm->frames[vm->frameCount - 1];
         } break;
-        case OP_BUILD_ARRAY: {
-            int cnt = READ_BYTE();
-
-            ObjArray *arr = newArray(vm);
-            pushRoot(vm, OBJ_VAL(arr));
-            for (int i = cnt - 1; i >= 0; i--) {
-                appendToArray(vm, arr, PEEK(i));
-            }
-            popRoot(vm);
-
-            vm->sp -= cnt;
-            PUSH(OBJ_VAL(arr));
-        } break;
-        case OP_BUILD_MAP: {
-            int cnt = READ_BYTE() * 2;
-
-            ObjMap *map = newMap(vm);
-            pushRoot(vm, OBJ_VAL(map));
-            for (int i = cnt - 1; i >= 0; i -= 2) {
-                Value key = PEEK(i);
-                if (!isHashable(key)) {
-                    runtimeError(vm, "%s is an unhashable type",
-                                 typeofValue(key));
-                    return INTERPRET_RUNTIME_ERR;
-                }
-                Value val = PEEK(i + 1);
-                tableSet(vm, &map->items, key, val);
-            }
-            popRoot(vm);
-
-            vm->sp -= cnt;
-            PUSH(OBJ_VAL(map));
+        case OP_BUILD_ARRAY: buildArray(vm, READ_BYTE()); break;
+        case OP_BUILD_MAP:   {
+            if (!buildMap(vm, READ_BYTE())) return INTERPRET_RUNTIME_ERR;
         } break;
         case OP_CLASS:   PUSH(OBJ_VAL(newClass(vm, READ_STRING()))); break;
         case OP_INHERIT: {
-            Value superclass = PEEK(1);
-            if (!IS_CLASS(superclass)) {
-                runtimeError(vm, "Superclass must be a class");
-                return INTERPRET_RUNTIME_ERR;
-            }
-
-            ObjClass *subclass = AS_CLASS(PEEK(0));
-            tableAddAll(vm, &AS_CLASS(superclass)->methods, &subclass->methods);
-            (void)POP(); // subclass
+            if (!inherit(vm)) return INTERPRET_RUNTIME_ERR;
         } break;
         case OP_METHOD: defineMethod(vm, READ_CONST()); break;
         case OP_NOP:    UNREACHABLE(); break;
@@ -740,7 +832,10 @@ static InterpretResult run(VM *vm) {
 InterpretResult interpret(VM *vm, const char *source) {
     ObjFn *function = compile(vm, source);
     if (function == NULL) return INTERPRET_COMPILE_ERR;
+    return interpretFunction(vm, function);
+}
 
+InterpretResult interpretFunction(VM *vm, ObjFn *function) {
     pushRoot(vm, OBJ_VAL(function));
     ObjClosure *closure = newClosure(vm, function);
     popRoot(vm);
@@ -749,3 +844,14 @@ InterpretResult interpret(VM *vm, const char *source) {
 
     return run(vm);
 }
+
+InterpretResult runCompiled(VM *vm, ObjFn *script) {
+    pushRoot(vm, OBJ_VAL(script));
+    ObjClosure *closure = newClosure(vm, script);
+    popRoot(vm);
+    push(vm, OBJ_VAL(closure));
+    if (!call(vm, closure, 0) || !script->compiled(vm)) {
+        return INTERPRET_RUNTIME_ERR;
+    }
+    return INTERPRET_OK;
+}
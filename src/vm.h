@@ -1,15 +1,18 @@
 #ifndef INCLUDE_CLOX_VM_H_
 #define INCLUDE_CLOX_VM_H_
 
+#include <pthread.h>
+
 #include "chunk.h"
 #include "common.h"
+#include "intern.h"
+#include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX     64
-#define STACK_MAX      (FRAMES_MAX * UINT8_COUNT)
-#define TEMP_ROOTS_MAX 8
+#define FRAMES_MAX 64
+#define STACK_MAX  (FRAMES_MAX * UINT8_COUNT)
 
 typedef struct {
     ObjClosure *closure;
@@ -17,6 +20,9 @@ typedef struct {
     Value *slots;
 } CallFrame;
 
+typedef struct CacheImage CacheImage;
+typedef struct SlabPage SlabPage;
+
 typedef struct VM {
     CallFrame frames[FRAMES_MAX];
     int frameCount;
@@ -25,20 +31,87 @@ typedef struct VM {
     Value *sp;
     Table globalNames;
     ValueArray globalValues;
-    Table strings;
+    InternSet strings;
     ObjString *initString;
     ObjUpvalue *openUpvalues;
 
     size_t bytesAllocated;
     size_t nextGC;
-    Obj *objects;
+    size_t nextMajorGC;
+    GcPacer pacer;
+    GcStats gcStats;
+    // pages with free slots, one list for each size of object
+    SlabPage *slabs[SLAB_CLASSES];
+    // the pages holding objects, the ones no objects are left in, and the
+    // ones the last major collection has not swept yet
+    SlabPage *pages;
+    SlabPage *emptyPages;
+    SlabPage *unswept;
+    // objects too big for a slab, each in a page of its own
+    SlabPage *largePages;
+    // memory from the os that pages are cut from
+    char **chunks;
+    int chunkCnt;
+    int chunkCap;
+    char *chunkNext;
+    char *chunkEnd;
+    bool gcHugePages;
+    // bump objects into pages and collect nothing until the heap is past
+    // pacer.maxHeap, for scripts that are done before garbage matters
+    bool gcArena;
+    // the page objects are bumped into in that mode
+    SlabPage *arena;
+    // objects allocated since the last collection
+    Obj **young;
+    int youngCnt;
+    int youngCap;
+    // old objects that were written to since the last collection
+    Obj **remembered;
+    int rememberedCnt;
+    int rememberedCap;
+    // old weak maps and refs, which every major collection has to clear
+    Obj **weak;
+    int weakCnt;
+    int weakCap;
+    // a minor collection only marks and sweeps young objects
+    bool collectingYoung;
+    // a major collection is marking the heap
+    bool gcMarking;
+    // mark on a thread of its own instead of in steps between allocations
+    bool gcConcurrent;
+    // the slots a step scans per allocation, the object that goes past it
+    // is still scanned whole
+    int gcStepWork;
+    // threads that trace the heap together in a major collection
+    int gcWorkers;
+    pthread_t marker;
+    bool markerRunning;
+    // the workers it uses, as the mutator may change gcWorkers meanwhile
+    int markerWorkers;
+    // set by the marking thread once it has run out of gray objects
+    bool markDone;
+    // buffers the marking thread might still be reading
+    DeferredFree *deferred;
+    int deferredCnt;
+    int deferredCap;
 
     int grayCnt;
     int grayCap;
     Obj **grayStack;
 
-    Value tempRoots[TEMP_ROOTS_MAX];
+    // values native code keeps alive while it allocates, see HandleScope
+    Value *tempRoots;
     int tempCnt;
+    int tempCap;
+    // no collections while objects are only partly built
+    bool gcPaused;
+
+    // only compile function bodies when they are first called
+    bool lazyCompile;
+    // .loxc files that functions are still loading their bodies from
+    CacheImage *caches;
+    // code for each function of the embedded .loxc of an --aot program
+    const CompiledFn *compiledFns;
 } VM;
 
 typedef enum {
@@ -50,12 +123,78 @@ typedef enum {
 void initVM(VM *vm);
 void freeVM(VM *vm);
 InterpretResult interpret(VM *vm, const char *source);
+InterpretResult interpretFunction(VM *vm, ObjFn *function);
 static inline void pushRoot(VM *vm, Value value) {
+    if (vm->tempCnt == vm->tempCap) growRoots(vm);
     vm->tempRoots[vm->tempCnt++] = value;
 }
 static inline void popRoot(VM *vm) { vm->tempCnt--; }
+
+// the roots pushed since a scope was opened are dropped when it is closed,
+// so code that builds something big can root every part of it as it goes
+// and not have to pop them one by one
+typedef struct {
+    VM *vm;
+    int base;
+} HandleScope;
+
+static inline HandleScope openScope(VM *vm) {
+    return (HandleScope){vm, vm->tempCnt};
+}
+
+static inline void closeScope(HandleScope *scope) {
+    // a runtime error may have dropped them already
+    if (scope->vm->tempCnt > scope->base) scope->vm->tempCnt = scope->base;
+}
+
+// opens a scope that is closed when the block it is in is left, however
+// that happens
+#define HANDLE_SCOPE(vm)                                                       \
+    HandleScope handleScope_ __attribute__((cleanup(closeScope))) =            \
+        openScope(vm)
 static inline void push(VM *vm, Value value) { *vm->sp++ = value; }
 static inline Value pop(VM *vm) { return *(--vm->sp); }
 static inline Value peek(VM *vm, int dist) { return vm->sp[-1 - dist]; }
 
+// has to be called after storing a reference into `owner`, so a minor
+// collection still finds young objects only an old one points to, and a
+// major one rescans everything written to while it was marking. the mark
+// bit is not looked at as the marking thread could be setting it
+static inline void writeBarrier(VM *vm, Obj *owner) {
+    if ((owner->isOld || vm->gcMarking) && !owner->isRemembered) {
+        rememberObject(vm, owner);
+    }
+}
+
+// the marking thread reads it, the write barrier makes up for it reading it
+// before it was set
+static inline void noteRef(ObjArray *arr, Value value) {
+    if (IS_OBJ(value)) __atomic_store_n(&arr->hasRefs, true, __ATOMIC_RELAXED);
+}
+
+static inline void appendToArray(VM *vm, ObjArray *arr, Value value) {
+    noteRef(arr, value);
+    writeValueArray(vm, &arr->items, value);
+    writeBarrier(vm, (Obj *)arr);
+}
+
+static inline void storeToArray(VM *vm, ObjArray *arr, int index,
+                                Value value) {
+    noteRef(arr, value);
+    storeValue(&arr->items.values[index], value);
+    writeBarrier(vm, (Obj *)arr);
+}
+
+// the elements after `index` move down one, which can take them past where
+// a marking thread is in the array, so it is scanned again like any write
+static inline void deleteFromArray(VM *vm, ObjArray *arr, int index) {
+    int cnt = arr->items.cnt - 1;
+    for (int i = index; i < cnt; i++) {
+        storeValue(&arr->items.values[i], arr->items.values[i + 1]);
+    }
+    storeValue(&arr->items.values[cnt], NIL_VAL);
+    __atomic_store_n(&arr->items.cnt, cnt, __ATOMIC_RELAXED);
+    writeBarrier(vm, (Obj *)arr);
+}
+
 #endif // INCLUDE_CLOX_VM_H_